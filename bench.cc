@@ -0,0 +1,529 @@
+#include "suffstack.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Benchmarks of each stack operation, swept over the sizes of the stack
+ * and of the string, against `naive_stack`, and of the multi-value
+ * workload from the README. Each operation is timed alone, many times,
+ * to report its median and 99th percentile latency as well as its
+ * throughput; unlike the cumulative timings in `tests.cc`, which are
+ * mixed with checking results.
+ *
+ * Rows are named `stack/operation/stack size/string size`, or
+ * `stack/workload/N/M` for the multi-value workload.
+ *
+ * Traces of operations, see `trace`, are replayed on both stacks: the
+ * multi-value workload's for each `N`, to find where the tree stack
+ * overtakes the naive one, and the one at `TRACE` if given, such as
+ * one recorded from a validator. `TRACE_OUT` names a file to write the
+ * multi-value workload's trace to, for `N = MAX_VALUES`.
+ *
+ * Tip: on Linux, use `column -s=$'\t' -t -R 2,3,4` to view the output table
+ */
+using namespace suffstack;
+
+struct config {
+  /** don't log integer configurations as they are parsed */
+  bool no_log_config = std::getenv("NO_LOG_CONFIG");
+  /** the largest stack swept */
+  unsigned long max_stack = integer("MAX_STACK", 1 << 16);
+  /** the largest string swept */
+  unsigned long max_string = integer("MAX_STRING", 1 << 10);
+  /** number of times each operation is timed at each size */
+  unsigned long samples = integer("SAMPLES", 1 << 10);
+  /** the largest number of values (N) of the multi-value workload */
+  unsigned long max_values = integer("MAX_VALUES", 1 << 10);
+  /** the number of calls (M) of the multi-value workload */
+  unsigned long calls = integer("CALLS", 1 << 10);
+  /** seed for the random number generator */
+  unsigned long seed = integer("RANDOM_SEED", 0);
+  /** a trace to replay */
+  const char *trace = std::getenv("TRACE");
+  /** where to write the multi-value workload's trace */
+  const char *trace_out = std::getenv("TRACE_OUT");
+
+  unsigned long integer(const char *env, unsigned long dflt) {
+    char *value = std::getenv(env);
+    if (!value) return dflt;
+    unsigned long i = std::stoul(value);
+    if (!no_log_config) {
+      std::cout << env << "=" << i << "\n";
+    }
+    return i;
+  }
+};
+
+static config cfg;
+
+static void escape(void *p) {
+#if defined __GNUC__
+  asm volatile("" : : "g"(p) : "memory");
+#else
+  (void)p;
+#endif
+}
+
+static void clobber() {
+#if defined __GNUC__
+  asm volatile("" ::: "memory");
+#endif
+}
+
+using bench_clock = std::chrono::steady_clock;
+using nanoseconds = std::chrono::duration<double, std::nano>;
+
+/** the time taken by `f`, less the time taken to read the clock */
+template <typename F> double time_ns(F &&f) {
+  static const double overhead = [] {
+    std::vector<double> empty(1 << 10);
+    for (double &ns : empty) {
+      auto start = bench_clock::now();
+      clobber();
+      ns = nanoseconds(bench_clock::now() - start).count();
+    }
+    std::ranges::nth_element(empty, empty.begin() + empty.size() / 2);
+    return empty[empty.size() / 2];
+  }();
+  clobber();
+  auto start = bench_clock::now();
+  f();
+  clobber();
+  double ns = nanoseconds(bench_clock::now() - start).count();
+  return std::max(0.0, ns - overhead);
+}
+
+/** the latency of each sample of an operation */
+struct latencies {
+  std::vector<double> ns;
+  double total = 0;
+
+  void add(double sample) {
+    ns.push_back(sample);
+    total += sample;
+  }
+  /** the latency which `fraction` of samples took at most */
+  double percentile(double fraction) {
+    auto nth = ns.begin() + std::min<size_t>(
+                                ns.size() - 1, size_t(fraction * ns.size())
+                            );
+    std::nth_element(ns.begin(), nth, ns.end());
+    return *nth;
+  }
+  /** operations a second */
+  double throughput() const { return total ? ns.size() / total * 1e9 : 0; }
+};
+
+static void print_header(const char *extra = "") {
+  std::cout << "Benchmark\tp50 (ns)\tp99 (ns)\tThroughput (/s)" << extra;
+}
+
+static void print_row(const std::string &name, latencies &times) {
+  std::cout << "\n"
+            << name << "\t" << times.percentile(0.5) << "\t"
+            << times.percentile(0.99) << "\t" << times.throughput();
+}
+
+/** the name of a row, `stack/operation/size/...` */
+template <typename... Sizes>
+static std::string
+row_name(const char *stack, const char *operation, Sizes... sizes) {
+  std::ostringstream name;
+  name << stack << "/" << operation;
+  ((name << "/" << sizes), ...);
+  return name.str();
+}
+
+/** print a row of a sweep over `N`, with how much its median grew
+    since the last `N`, a quarter of this one; about 4 for O(N) and
+    near 1 for O(log N) */
+static void
+print_growth_row(const std::string &name, latencies &times, double &last) {
+  print_row(name, times);
+  double median = times.percentile(0.5);
+  if (last) std::cout << "\t" << median / last;
+  last = median;
+}
+
+/** the stacks under test and how to make their strings */
+struct naive_impl {
+  static constexpr const char *name = "naive_stack";
+  using stack = naive_stack<int>;
+
+  stack make_stack() { return {}; }
+  std::vector<int> make_string(const std::vector<int> &values) {
+    return values;
+  }
+};
+struct tree_impl {
+  static constexpr const char *name = "tree_stack";
+  using stack = tree_stack<int>;
+  node_arena arena;
+
+  stack make_stack() { return stack(arena); }
+  indexed_string_over<int> make_string(const std::vector<int> &values) {
+    return {arena, values};
+  }
+};
+struct hybrid_impl {
+  static constexpr const char *name = "hybrid_stack";
+  using stack = hybrid_stack<int>;
+  node_arena arena;
+
+  stack make_stack() { return stack(arena); }
+  hybrid_string<int> make_string(const std::vector<int> &values) {
+    return values;
+  }
+};
+
+/** time `has_suffix` on a suffix which matches, the worst case for
+    `naive_stack`, and `append` and `truncate` of a string, on stacks of
+    each size */
+template <typename Impl> void sweep_operations(std::mt19937 &rng) {
+  for (size_t stack_size = 1 << 6; stack_size <= cfg.max_stack;
+       stack_size *= 4) {
+    std::vector<int> values(stack_size);
+    for (int &v : values) v = (int)(rng() % 2);
+    for (size_t length = 1;
+         length <= std::min<size_t>(stack_size, cfg.max_string);
+         length *= 8) {
+      Impl impl;
+      auto stk = impl.make_stack();
+      stk.append(impl.make_string(values));
+      auto top = impl.make_string({values.end() - length, values.end()});
+      latencies has_suffix, append, truncate;
+      for (size_t sample = 0; sample < cfg.samples; ++sample) {
+        has_suffix.add(time_ns([&]() {
+          bool found = stk.has_suffix(top);
+          escape(&found);
+        }));
+        append.add(time_ns([&]() { stk.append(top); }));
+        stk.truncate(stack_size);
+        truncate.add(time_ns([&]() { stk.truncate(stack_size - length); }));
+        stk.append(top);
+      }
+      print_row(
+          row_name(Impl::name, "has_suffix", stack_size, length), has_suffix
+      );
+      print_row(row_name(Impl::name, "append", stack_size, length), append);
+      print_row(
+          row_name(Impl::name, "truncate", stack_size, length), truncate
+      );
+    }
+  }
+}
+
+/** the README's worst case: `M` calls of a function with `N` params
+    and `N` results, each checking its params are on the stack and
+    replacing them with its results; O(N M) for `naive_stack` */
+template <typename Impl> void multi_value_workload() {
+  double last = 0;
+  for (size_t count = 1 << 2; count <= cfg.max_values; count *= 4) {
+    Impl impl;
+    auto params = impl.make_string(std::vector<int>(count, 0));
+    auto stk = impl.make_stack();
+    stk.append(params);
+    latencies calls;
+    for (size_t call = 0; call < cfg.calls; ++call) {
+      calls.add(time_ns([&]() {
+        bool valid = stk.has_suffix(params);
+        escape(&valid);
+        stk.pop(count);
+        stk.append(params);
+      }));
+    }
+    print_growth_row(
+        row_name(Impl::name, "multi_value", count, cfg.calls),
+        calls,
+        last
+    );
+  }
+}
+
+/** the multi-value workload checking and replacing in one descent, with
+    `tree_stack_base::apply` */
+void multi_value_apply() {
+  double last = 0;
+  for (size_t count = 1 << 2; count <= cfg.max_values; count *= 4) {
+    tree_impl impl;
+    auto params = impl.make_string(std::vector<int>(count, 0));
+    auto stk = impl.make_stack();
+    stk.append(params);
+    latencies calls;
+    for (size_t call = 0; call < cfg.calls; ++call) {
+      calls.add(time_ns([&]() {
+        bool valid = stk.apply(params, params);
+        escape(&valid);
+      }));
+    }
+    print_growth_row(
+        row_name(tree_impl::name, "multi_value_apply", count, cfg.calls),
+        calls,
+        last
+    );
+  }
+}
+
+/**
+ * A trace of stack operations, written one to a line as
+ *
+ *     s <id> <value>...  define string <id>, its values bottom first
+ *     a <id>             append string <id>
+ *     h <id>             check whether string <id> is a suffix
+ *     t <size>           truncate to <size>
+ *
+ * with `#` starting a comment line. Strings are defined once, with ids
+ * counting up from 0, and then used by id, as a validator indexes each
+ * function type once and uses it for every call.
+ */
+struct trace {
+  enum operation : char { append = 'a', has_suffix = 'h', truncate = 't' };
+  struct op {
+    operation kind;
+    /** the id of the string, or the size to truncate to */
+    size_t arg;
+  };
+  std::vector<std::vector<int>> strings;
+  std::vector<op> ops;
+
+  /** throws `std::runtime_error` if `in` is not a valid trace */
+  static trace read(std::istream &in) {
+    trace read;
+    size_t size = 0, line_no = 0;
+    auto fail = [&](const char *why) {
+      throw std::runtime_error(
+          "trace line " + std::to_string(line_no) + ": " + why
+      );
+    };
+    for (std::string line; std::getline(in, line);) {
+      ++line_no;
+      std::istringstream fields(line);
+      char kind;
+      if (!(fields >> kind) || kind == '#') continue;
+      size_t arg;
+      if (!(fields >> arg)) fail("expected a number");
+      if (kind == 's') {
+        if (arg != read.strings.size()) fail("strings must count up from 0");
+        std::vector<int> &string = read.strings.emplace_back();
+        for (int value; fields >> value;) string.push_back(value);
+        continue;
+      }
+      if (kind == append || kind == has_suffix) {
+        if (arg >= read.strings.size()) fail("undefined string");
+        if (kind == append) size += read.strings[arg].size();
+      } else if (kind == truncate) {
+        if (arg > size) fail("truncating past the top of the stack");
+        size = arg;
+      } else {
+        fail("unknown operation");
+      }
+      read.ops.push_back({(operation)kind, arg});
+    }
+    return read;
+  }
+  void write(std::ostream &out) const {
+    for (size_t id = 0; id < strings.size(); ++id) {
+      out << "s " << id;
+      for (int value : strings[id]) out << " " << value;
+      out << "\n";
+    }
+    for (const op &op : ops) out << (char)op.kind << " " << op.arg << "\n";
+  }
+
+  /** the README's workload: `values` constants pushed one at a time,
+      then `calls` calls with `values` params and results */
+  static trace multi_value(size_t values, size_t calls) {
+    trace generated;
+    generated.strings = {{0}, std::vector<int>(values, 0)};
+    for (size_t i = 0; i < values; ++i) generated.ops.push_back({append, 0});
+    for (size_t i = 0; i < calls; ++i) {
+      generated.ops.push_back({has_suffix, 1});
+      generated.ops.push_back({truncate, 0});
+      generated.ops.push_back({append, 1});
+    }
+    return generated;
+  }
+};
+
+/** time round trips of `has_suffix`, `pop` and `append` of `str`, the
+    hot loop of a validator, averaged over a batch for each sample */
+template <typename Stack>
+static void round_trips(
+    const std::string &name,
+    Stack &stk,
+    const typename Stack::string_type &str
+) {
+  constexpr size_t batch = 64;
+  latencies trips;
+  for (size_t sample = 0; sample < cfg.samples; ++sample) {
+    trips.add(time_ns([&]() {
+                for (size_t trip = 0; trip < batch; ++trip) {
+                  bool found = stk.has_suffix(str);
+                  escape(&found);
+                  stk.pop(str.size());
+                  stk.append(str);
+                }
+              }) /
+              batch);
+  }
+  print_row(name, trips);
+}
+
+/** round trips called directly on each stack, as by a validator
+    templated on its stack, and through `suffix_stack`, with strings
+    short enough for the call to matter */
+template <typename Impl> void dispatch_round_trips(std::mt19937 &rng) {
+  std::vector<int> values(1 << 6);
+  for (int &v : values) v = (int)(rng() % 2);
+  for (size_t length = 1; length <= tree_stack_base::tiny_size;
+       length *= 2) {
+    Impl impl;
+    auto str = impl.make_string({values.end() - length, values.end()});
+    auto stk = impl.make_stack();
+    stk.append(impl.make_string(values));
+    round_trips(row_name(Impl::name, "static", length), stk, str);
+
+    virtual_stack<typename Impl::stack> wrapped(impl.make_stack());
+    wrapped.append(impl.make_string(values));
+    // hidden from the compiler, which would otherwise call `wrapped`
+    // directly
+    suffix_stack<typename Impl::stack::string_type, int> *virtual_ =
+        &wrapped;
+    escape(&virtual_);
+    round_trips(row_name(Impl::name, "virtual", length), *virtual_, str);
+  }
+}
+
+/** the time to replay a trace, and how many suffixes matched */
+struct replay_result {
+  double index_ns = 0, ops_ns = 0;
+  size_t matched = 0;
+};
+
+/** index the strings of `replayed`, then replay its operations */
+template <typename Impl> replay_result replay(const trace &replayed) {
+  Impl impl;
+  replay_result result;
+  std::vector<decltype(impl.make_string({}))> strings;
+  result.index_ns = time_ns([&]() {
+    strings.reserve(replayed.strings.size());
+    for (const std::vector<int> &string : replayed.strings) {
+      strings.push_back(impl.make_string(string));
+    }
+  });
+  auto stk = impl.make_stack();
+  result.ops_ns = time_ns([&]() {
+    for (const trace::op &op : replayed.ops) {
+      switch (op.kind) {
+      case trace::append:
+        stk.append(strings[op.arg]);
+        break;
+      case trace::has_suffix:
+        result.matched += stk.has_suffix(strings[op.arg]);
+        break;
+      case trace::truncate:
+        stk.truncate(op.arg);
+        break;
+      }
+    }
+  });
+  return result;
+}
+
+static void print_replay_header() {
+  std::cout << "Trace\tOperations\tnaive_stack (ns/op)\ttree_stack (ns/op)"
+               "\thybrid_stack (ns/op)\tSpeedup\tIndexing (ns)";
+}
+
+/** replay `replayed` on each stack, returning whether the tree stack
+    was the faster */
+static bool replay_row(const std::string &name, const trace &replayed) {
+  replay_result naive = replay<naive_impl>(replayed);
+  replay_result tree = replay<tree_impl>(replayed);
+  replay_result hybrid = replay<hybrid_impl>(replayed);
+  if (naive.matched != tree.matched || naive.matched != hybrid.matched) {
+    throw std::runtime_error(name + ": the stacks disagree");
+  }
+  double ops = std::max<size_t>(1, replayed.ops.size());
+  std::cout << "\n"
+            << name << "\t" << replayed.ops.size() << "\t"
+            << naive.ops_ns / ops << "\t" << tree.ops_ns / ops << "\t"
+            << hybrid.ops_ns / ops << "\t"
+            << naive.ops_ns / std::max(1.0, tree.ops_ns) << "\t"
+            << tree.index_ns;
+  return tree.ops_ns < naive.ops_ns;
+}
+
+/** replay the multi-value workload for each `N`, and report the
+    smallest from which the tree stack is faster for every `N` */
+void multi_value_crossover() {
+  size_t crossover = 0;
+  for (size_t count = 1; count <= cfg.max_values; count *= 2) {
+    trace generated = trace::multi_value(count, cfg.calls);
+    std::string name = row_name("replay", "multi_value", count, cfg.calls);
+    bool faster = replay_row(name, generated);
+    if (!faster) {
+      crossover = 0;
+    } else if (!crossover) {
+      crossover = count;
+    }
+  }
+  std::cout << "\nCrossover (N)\t";
+  if (crossover) {
+    std::cout << crossover;
+  } else {
+    std::cout << "none up to " << cfg.max_values;
+  }
+}
+
+int main() {
+  std::mt19937 rng(cfg.seed);
+  print_header();
+  sweep_operations<naive_impl>(rng);
+  sweep_operations<tree_impl>(rng);
+  sweep_operations<hybrid_impl>(rng);
+  std::cout << "\n\n";
+  print_header("\tGrowth");
+  multi_value_workload<naive_impl>();
+  multi_value_workload<tree_impl>();
+  multi_value_workload<hybrid_impl>();
+  multi_value_apply();
+  std::cout << "\n\n";
+  print_header();
+  dispatch_round_trips<naive_impl>(rng);
+  dispatch_round_trips<tree_impl>(rng);
+  dispatch_round_trips<hybrid_impl>(rng);
+  std::cout << "\n\n";
+
+  try {
+    print_replay_header();
+    multi_value_crossover();
+    if (cfg.trace) {
+      std::ifstream in(cfg.trace);
+      if (!in) {
+        throw std::runtime_error(std::string("can't open ") + cfg.trace);
+      }
+      replay_row(cfg.trace, trace::read(in));
+    }
+    if (cfg.trace_out) {
+      std::ofstream out(cfg.trace_out);
+      trace::multi_value(cfg.max_values, cfg.calls).write(out);
+      if (!out) {
+        throw std::runtime_error(std::string("can't write ") + cfg.trace_out);
+      }
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "\n" << e.what() << "\n";
+    return 1;
+  }
+  std::cout << "\n";
+}
@@ -10,9 +10,297 @@ bool node::operator<(const node &o) const {
   return false;
 }
 
-void indexed_string::index_from(node_arena &f, nodes &&paired) {
-  assocs.resize(paired.size() + 1);
-  if (paired.size() == 0) return;
+#if SUFFSTACK_CHECK_ROLLBACK
+void arena_registration::track(node_arena_base *to) {
+  if (to == arena) return;
+  for (node_arena_base *a = arena; a; a = a->parent) {
+    std::lock_guard lock(a->registrations_mutex);
+    a->registrations.erase(this);
+  }
+  arena = to;
+  for (node_arena_base *a = arena; a; a = a->parent) {
+    std::lock_guard lock(a->registrations_mutex);
+    a->registrations.insert(this);
+  }
+}
+
+void node_arena_base::check_unreferenced(
+    const std::function<bool(const node *)> &discarded
+) const {
+  std::lock_guard lock(registrations_mutex);
+  for (const arena_registration *reg : registrations) {
+    reg->visit(*reg, [&](const node_or_leaf *tree, size_t height) {
+      assert(
+          (!height || !tree || !discarded(static_cast<const node *>(tree))) &&
+          "a discarded node is still in use"
+      );
+    });
+  }
+}
+#endif
+
+node *node_slabs::allocate(const node_or_leaf *lhs, const node_or_leaf *rhs) {
+  if (reused < freed.size()) {
+    ++reused;
+    return new (freed[freed.size() - reused]) node(lhs, rhs);
+  }
+  if (used == slabs.size() * slab_size) {
+    node *slab = static_cast<node *>(::operator new(slab_size * sizeof(node)));
+    slabs.emplace_back(slab);
+    std::pair<const node *, size_t> entry(slab, slabs.size() - 1);
+    by_address.insert(
+        std::upper_bound(
+            by_address.begin(),
+            by_address.end(),
+            entry,
+            [](const auto &lhs, const auto &rhs) {
+              return std::less<>()(lhs.first, rhs.first);
+            }
+        ),
+        entry
+    );
+  }
+  return new ((*this)[used++]) node(lhs, rhs);
+}
+
+uint64_t leaf_relation::next_id() {
+  static std::atomic<uint64_t> next{0};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t node_arena_base::next_leaves_id() {
+  static std::atomic<uint64_t> next{0};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool node_arena_base::subsumes(
+    const leaf_relation &relation,
+    const node_or_leaf *ours,
+    const node_or_leaf *theirs,
+    size_t height
+) {
+  if (ours == theirs) return true;
+  if (!height) return relation.related(ours, theirs);
+  subsumption key{relation.id, ours, theirs};
+  {
+    std::lock_guard lock(subsumptions_mutex);
+    size_t discarded = lineage_discards();
+    if (discarded != subsumptions_discards) {
+      // an ancestor discarded nodes we may have compared
+      subsumptions.clear();
+      subsumptions_discards = discarded;
+    }
+    auto found = subsumptions.find(key);
+    if (found != subsumptions.end()) return found->second;
+  }
+  const node &our_node = static_cast<const node &>(*ours);
+  const node &their_node = static_cast<const node &>(*theirs);
+  bool result =
+      subsumes(relation, our_node.lhs, their_node.lhs, height - 1) &&
+      subsumes(relation, our_node.rhs, their_node.rhs, height - 1);
+  std::lock_guard lock(subsumptions_mutex);
+  subsumptions.emplace(key, result);
+  return result;
+}
+
+void node_arena_base::forget_subsumptions() {
+  std::lock_guard lock(subsumptions_mutex);
+  ++discards;
+  subsumptions.clear();
+  subsumptions_discards = lineage_discards();
+}
+
+size_t node_arena_base::lineage_discards() const {
+  size_t total = 0;
+  for (const node_arena_base *a = this; a; a = a->parent) {
+    total += a->discards.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void node_slabs::free(node *n) {
+  // reused nodes are no longer free
+  freed.resize(freed.size() - reused);
+  reused = 0;
+  freed.push_back(n);
+}
+
+size_t node_slabs::index_of(const node *n) const {
+  std::less<> lt;
+  auto after = std::upper_bound(
+      by_address.begin(),
+      by_address.end(),
+      n,
+      [&](const node *n, const auto &entry) { return lt(n, entry.first); }
+  );
+  if (after == by_address.begin()) return used;
+  const auto &[begin, slab] = after[-1];
+  if (!lt(n, begin + slab_size)) return used;
+  size_t idx = slab * slab_size + (n - begin);
+  return idx < used ? idx : used;
+}
+
+bool node_slabs::allocated_since(position pos, const node *n) const {
+  size_t idx = index_of(n);
+  if (idx == used) return false;
+  if (idx >= pos.used) return true;
+  auto first = freed.end() - reused, last = freed.end() - pos.reused;
+  return first < last && std::find(first, last, n) != last;
+}
+
+void node_slabs::clear() {
+  slabs.clear();
+  by_address.clear();
+  used = 0;
+  freed.clear();
+  reused = 0;
+}
+
+const node_or_leaf *
+node_promotion::operator()(const node_or_leaf *tree, size_t height) {
+  if (!height || !tree) return tree;
+  const node *n = static_cast<const node *>(tree);
+  auto found = promoted.find(n);
+  if (found != promoted.end()) return found->second;
+  if (from.find_local(n->lhs, n->rhs) != n) {
+    // from an ancestor
+    return n;
+  }
+  const node_or_leaf *lhs = (*this)(n->lhs, height - 1);
+  const node_or_leaf *rhs = (*this)(n->rhs, height - 1);
+  const node *replacement = into.intern(lhs, rhs);
+  promoted.emplace(n, replacement);
+  return replacement;
+}
+
+struct concurrent_node_slabs::slab {
+  slab *prev;
+  std::atomic<size_t> used;
+  alignas(chained_node) unsigned char storage[slab_size * sizeof(chained_node)];
+
+  slab(slab *prev) : prev(prev), used(1) {}
+  chained_node *at(size_t i) {
+    return reinterpret_cast<chained_node *>(storage) + i;
+  }
+};
+
+concurrent_node_slabs::~concurrent_node_slabs() {
+  slab *s = current.load(std::memory_order_relaxed);
+  while (s) {
+    slab *prev = s->prev;
+    delete s;
+    s = prev;
+  }
+}
+
+chained_node *concurrent_node_slabs::allocate(
+    const node_or_leaf *lhs,
+    const node_or_leaf *rhs,
+    size_t hash
+) {
+  slab *s = current.load(std::memory_order_acquire);
+  while (true) {
+    if (s) {
+      size_t i = s->used.fetch_add(1, std::memory_order_relaxed);
+      if (i < slab_size) return new (s->at(i)) chained_node(lhs, rhs, hash);
+    }
+    // the slab is exhausted, the first thread to publish a fresh one
+    // wins and the rest retry with it
+    slab *fresh = new slab(s);
+    if (current.compare_exchange_strong(
+            s, fresh, std::memory_order_acq_rel, std::memory_order_acquire
+        )) {
+      return new (fresh->at(0)) chained_node(lhs, rhs, hash);
+    }
+    delete fresh;
+  }
+}
+
+thread_pool::thread_pool(size_t workers) {
+  this->workers.reserve(workers);
+  for (size_t i = 0; i < workers; ++i) {
+    this->workers.emplace_back([this] { work(); });
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers) worker.join();
+}
+
+void thread_pool::parallel_for(
+    size_t count,
+    size_t grain,
+    const std::function<void(size_t, size_t)> &body
+) {
+  if (!count) return;
+  grain = std::max<size_t>(grain, 1);
+  if (workers.empty() || count <= grain) {
+    body(0, count);
+    return;
+  }
+  {
+    std::lock_guard lock(mutex);
+    this->body = &body;
+    this->count = count;
+    // a few chunks per thread, so uneven chunks even out
+    chunk = std::max(grain, count / (4 * size()) + 1);
+    next_chunk.store(0, std::memory_order_relaxed);
+    busy = workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+  run_chunks();
+  std::unique_lock lock(mutex);
+  done.wait(lock, [this] { return busy == 0; });
+  this->body = nullptr;
+}
+
+void thread_pool::run_chunks() {
+  for (;;) {
+    size_t begin = next_chunk.fetch_add(chunk, std::memory_order_relaxed);
+    if (begin >= count) return;
+    (*body)(begin, std::min(count, begin + chunk));
+  }
+}
+
+void thread_pool::work() {
+  size_t seen = 0;
+  std::unique_lock lock(mutex);
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) return;
+    seen = generation;
+    lock.unlock();
+    run_chunks();
+    lock.lock();
+    if (--busy == 0) done.notify_one();
+  }
+}
+
+void indexed_string::index_from(node_arena_base &f, nodes &&leaves) {
+  index_paired(f, leaves);
+}
+
+void indexed_string::index_from(
+    node_arena_base &f,
+    leaf_span leaves,
+    index_workspace &workspace
+) {
+  workspace.paired.assign(leaves.begin(), leaves.end());
+  index_paired(f, workspace.paired);
+}
+
+void indexed_string::index_paired(node_arena_base &f, nodes &paired) {
+  track(&f);
+  length = paired.size();
+  size_t right_offset = offset_of(length + 1);
+  trees.assign(2 * right_offset, nullptr);
+  if (length == 0) return;
 
   for (size_t bit = 0;; ++bit)
   /* O(log N) iterations */ {
@@ -24,14 +312,11 @@ void indexed_string::index_from(node_arena &f, nodes &&paired) {
     {
       // constant work in body
       bool set = sz & bit_m;
-      auto &left = assocs.begin()[sz].left, &right = assocs.rbegin()[sz].right;
       if (set) {
         size_t offset = sz & (bit_m - 1);
-        left.push_back(paired.begin()[offset]);
-        right.push_back(paired.rbegin()[offset]);
-      } else {
-        left.push_back(nullptr);
-        right.push_back(nullptr);
+        size_t at = offset_of(sz) + bit;
+        trees[at] = paired.begin()[offset];
+        trees[right_offset + at] = paired.rbegin()[offset];
       }
     }
     if (the_bit(bit + 1) > size()) break;
@@ -47,17 +332,544 @@ void indexed_string::index_from(node_arena &f, nodes &&paired) {
   }
 }
 
+void indexed_string::index_from(
+    node_arena_base &f,
+    nodes &&leaves,
+    const parallel_indexing &parallel
+) {
+  if (leaves.size() < parallel.cutoff || parallel.pool.size() == 1) {
+    index_paired(f, leaves);
+    return;
+  }
+  track(&f);
+  length = leaves.size();
+  size_t right_offset = offset_of(length + 1);
+  trees.assign(2 * right_offset, nullptr);
+
+  // the same levels as index_paired, but pairing into a second buffer
+  // since pairing in place would read trees other threads overwrite
+  nodes paired = std::move(leaves), next;
+  next.reserve(paired.size());
+  size_t grain = parallel.cutoff;
+  for (size_t bit = 0;; ++bit) {
+    size_t bit_m = the_bit(bit);
+    // each size writes its own slots, so sizes split freely
+    parallel.pool.parallel_for(
+        length + 1 - bit_m,
+        grain,
+        [&](size_t begin, size_t end) {
+          for (size_t sz = bit_m + begin; sz < bit_m + end; ++sz) {
+            if (!(sz & bit_m)) continue;
+            size_t offset = sz & (bit_m - 1);
+            size_t at = offset_of(sz) + bit;
+            trees[at] = paired.begin()[offset];
+            trees[right_offset + at] = paired.rbegin()[offset];
+          }
+        }
+    );
+    if (the_bit(bit + 1) > size()) break;
+    size_t pairings = paired.size() - bit_m;
+    next.resize(pairings);
+    parallel.pool.parallel_for(
+        pairings,
+        grain,
+        [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            next[i] = f.intern(paired[i], paired[i + bit_m]);
+          }
+        }
+    );
+    std::swap(paired, next);
+  }
+}
+
+/** number `tree` and the nodes below it which aren't numbered yet, in
+    `by_height[height - 1]` by height */
+static void number_nodes(
+    const node_or_leaf *tree,
+    size_t height,
+    std::unordered_set<const node *> &numbered,
+    std::vector<std::vector<const node *>> &by_height
+) {
+  if (!height) return;
+  const node *n = static_cast<const node *>(tree);
+  if (!numbered.insert(n).second) return;
+  if (by_height.size() < height) by_height.resize(height);
+  by_height[height - 1].push_back(n);
+  number_nodes(n->lhs, height - 1, numbered, by_height);
+  number_nodes(n->rhs, height - 1, numbered, by_height);
+}
+
+/** call `f(word, height, size)` with each word of the trees of a
+    string of length `length`, in the order `indexed_string` stores
+    them, with the size of the side of the split it belongs to; that
+    side has a tree of `height` if `size` has that bit set, and null
+    otherwise */
+template <typename Word, typename F>
+static void for_each_string_tree(size_t length, Word *words, F f) {
+  for (int side = 0; side < 2; ++side) {
+    for (size_t sz = 0; sz <= length; ++sz) {
+      for (size_t bit = 0; bit < (size_t)std::bit_width(sz); ++bit) {
+        f(*words++, bit, sz);
+      }
+    }
+  }
+}
+
+static constexpr size_t header_words =
+    sizeof(mapped_node_arena::image_header) / sizeof(uint64_t);
+
+static size_t image_table_index(const node &n, size_t table_bits) {
+  // Fibonacci hashing, as in basic_node_arena
+  return (std::hash<node>()(n) * 0x9e3779b97f4a7c15ull) >>
+         (std::numeric_limits<size_t>::digits - table_bits);
+}
+
+/** fill the table of an image from its nodes */
+static void fill_image_table(uint64_t *table, const node *nodes,
+                              size_t node_count, size_t table_bits) {
+  size_t mask = the_bit(table_bits) - 1;
+  std::fill(table, table + mask + 1, 0);
+  for (size_t idx = 0; idx < node_count; ++idx) {
+    size_t i = image_table_index(nodes[idx], table_bits);
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = idx + 1;
+  }
+}
+
+std::vector<uint64_t> mapped_node_arena::write_image(
+    std::span<const indexed_string *const> strings,
+    uintptr_t preferred_base
+) {
+  std::unordered_set<const node *> numbered;
+  std::vector<std::vector<const node *>> by_height;
+  for (const indexed_string *string : strings) {
+    string->visit_trees([&](const node_or_leaf *tree, size_t height) {
+      if (tree) number_nodes(tree, height, numbered, by_height);
+    });
+  }
+  // those with leaves as children first, then the rest
+  std::vector<const node *> order;
+  order.reserve(numbered.size());
+  for (const std::vector<const node *> &level : by_height) {
+    order.insert(order.end(), level.begin(), level.end());
+  }
+  std::unordered_map<const node *, uint64_t> address;
+  for (size_t idx = 0; idx < order.size(); ++idx) {
+    address[order[idx]] =
+        preferred_base + (header_words + 2 * idx) * sizeof(uint64_t);
+  }
+  auto prelinked = [&](const node_or_leaf *tree) {
+    return address.at(static_cast<const node *>(tree));
+  };
+
+  size_t table_bits = std::bit_width(2 * order.size());
+  size_t size = header_words + 2 * order.size() + the_bit(table_bits);
+  for (const indexed_string *string : strings) {
+    size += 1 + 2 * indexed_string::offset_of(string->length + 1);
+  }
+  std::vector<uint64_t> image(size);
+  image_header header{
+      {},
+      version,
+      preferred_base,
+      size,
+      order.size(),
+      by_height.empty() ? 0 : by_height.front().size(),
+      table_bits,
+      strings.size(),
+  };
+  std::memcpy(header.magic, magic, sizeof(magic));
+  std::memcpy(image.data(), &header, sizeof(header));
+
+  uint64_t *words = image.data() + header_words;
+  for (size_t idx = 0; idx < order.size(); ++idx) {
+    const node *n = order[idx];
+    bool leaves = idx < header.leaf_parents;
+    *words++ = leaves ? (uintptr_t)n->lhs : prelinked(n->lhs);
+    *words++ = leaves ? (uintptr_t)n->rhs : prelinked(n->rhs);
+  }
+  fill_image_table(
+      words,
+      reinterpret_cast<const node *>(image.data() + header_words),
+      order.size(),
+      table_bits
+  );
+  words += the_bit(table_bits);
+
+  for (const indexed_string *string : strings) {
+    *words++ = string->length;
+    auto tree = string->trees.begin();
+    for_each_string_tree(
+        string->length,
+        words,
+        [&](uint64_t &word, size_t h, size_t) {
+          word = h && *tree ? prelinked(*tree) : (uintptr_t)*tree;
+          ++tree;
+        }
+    );
+    words += string->trees.size();
+  }
+  return image;
+}
+
+bool mapped_node_arena::valid(std::span<const uint64_t> image) {
+  if (image.size() < header_words) return false;
+  image_header h;
+  std::memcpy(&h, image.data(), sizeof(h));
+  if (!std::equal(magic, magic + sizeof(magic), h.magic) ||
+      h.version != version || h.size < header_words ||
+      h.size > image.size()) {
+    return false;
+  }
+  // in this order, so that none of the sizes can overflow
+  size_t words = h.size - header_words;
+  if (h.node_count > words / 2 || h.leaf_parents > h.node_count ||
+      h.table_bits >= (uint64_t)std::bit_width(words) ||
+      the_bit(h.table_bits) <= h.node_count) {
+    return false;
+  }
+  words -= 2 * h.node_count;
+  if (the_bit(h.table_bits) > words) return false;
+  words -= the_bit(h.table_bits);
+
+  // the height of the node `word` refers to, or 0 if it refers to none
+  // of the nodes before `end`
+  std::vector<uint8_t> heights(h.node_count);
+  auto height_of = [&](uint64_t word, size_t end) -> size_t {
+    uint64_t offset = word - h.preferred_base - header_words * 8;
+    if (offset % 16 || offset / 16 >= end) return 0;
+    return heights[offset / 16];
+  };
+  const uint64_t *node_words = image.data() + header_words;
+  for (size_t idx = 0; idx < h.node_count; ++idx) {
+    if (idx < h.leaf_parents) {
+      heights[idx] = 1;
+      continue;
+    }
+    // children come before their parents
+    size_t lhs = height_of(node_words[2 * idx], idx);
+    size_t rhs = height_of(node_words[2 * idx + 1], idx);
+    if (!lhs || lhs != rhs || lhs >= std::numeric_limits<size_t>::digits) {
+      return false;
+    }
+    heights[idx] = (uint8_t)(lhs + 1);
+  }
+
+  // each node can be found in the table, which has free slots to end
+  // the search, as the seen nodes are all distinct; O(node_count)
+  // expected for an image written by `write_image`
+  const uint64_t *table = node_words + 2 * h.node_count;
+  const node *nodes = reinterpret_cast<const node *>(node_words);
+  size_t mask = the_bit(h.table_bits) - 1, filled = 0;
+  for (size_t i = 0; i <= mask; ++i) {
+    if (table[i] > h.node_count) return false;
+    filled += table[i] != 0;
+  }
+  if (filled != h.node_count) return false;
+  for (size_t idx = 0; idx < h.node_count; ++idx) {
+    size_t i = image_table_index(nodes[idx], h.table_bits);
+    for (; table[i] && table[i] != idx + 1; i = (i + 1) & mask) {}
+    if (!table[i]) return false;
+  }
+
+  const uint64_t *string = table + the_bit(h.table_bits);
+  if (h.string_count > words) return false;
+  for (size_t i = 0; i < h.string_count; ++i) {
+    if (!words || string[0] >= words) return false;
+    size_t length = string[0];
+    size_t tree_words = 2 * indexed_string::offset_of(length + 1);
+    if (tree_words > words - 1) return false;
+    bool trees_valid = true;
+    for_each_string_tree(
+        length,
+        string + 1,
+        [&](uint64_t word, size_t height, size_t side_size) {
+          // leaves are values, any of which is valid
+          if (!height) return;
+          if (side_size & the_bit(height)) {
+            trees_valid &= height_of(word, heights.size()) == height;
+          } else {
+            trees_valid &= !word;
+          }
+        }
+    );
+    if (!trees_valid) return false;
+    string += 1 + tree_words;
+    words -= 1 + tree_words;
+  }
+  return true;
+}
+
+std::unique_ptr<mapped_node_arena> mapped_node_arena::load(
+    std::span<const uint64_t> image,
+    node_arena_base *parent
+) {
+  if (!valid(image)) return nullptr;
+  return std::unique_ptr<mapped_node_arena>(
+      new mapped_node_arena(image, parent)
+  );
+}
+
+mapped_node_arena::mapped_node_arena(
+    std::span<const uint64_t> image,
+    node_arena_base *parent
+)
+    : node_arena_base(parent),
+      header(reinterpret_cast<const image_header *>(image.data())) {
+  const uint64_t *words = image.data();
+  uintptr_t preferred = header->preferred_base;
+  if ((uintptr_t)words != preferred) {
+    copy.assign(words, words + header->size);
+    header = reinterpret_cast<const image_header *>(copy.data());
+    words = copy.data();
+  }
+  nodes = reinterpret_cast<const node *>(words + header_words);
+  table = words + header_words + 2 * header->node_count;
+
+  const uint64_t *string = table + the_bit(header->table_bits);
+  strings.reserve(header->string_count);
+  for (size_t i = 0; i < header->string_count; ++i) {
+    strings.push_back(string);
+    string += 1 + 2 * indexed_string::offset_of(*string + 1);
+  }
+  if (!relocated()) return;
+
+  // O(image.size())
+  uint64_t delta = (uintptr_t)copy.data() - preferred;
+  uint64_t *node_words = copy.data() + header_words;
+  for (size_t idx = header->leaf_parents; idx < header->node_count; ++idx) {
+    node_words[2 * idx] += delta;
+    node_words[2 * idx + 1] += delta;
+  }
+  fill_image_table(
+      const_cast<uint64_t *>(table),
+      nodes,
+      header->node_count,
+      header->table_bits
+  );
+  for (const uint64_t *at : strings) {
+    uint64_t *string_words = const_cast<uint64_t *>(at);
+    for_each_string_tree(*string_words, string_words + 1, [&](
+        uint64_t &word, size_t height, size_t) {
+      if (height && word) word += delta;
+    });
+  }
+}
+
+const node *mapped_node_arena::find_local(
+    const node_or_leaf *lhs,
+    const node_or_leaf *rhs
+) const {
+  size_t mask = the_bit(header->table_bits) - 1;
+  for (size_t i = image_table_index(node(lhs, rhs), header->table_bits);
+       table[i]; i = (i + 1) & mask) {
+    const node &n = nodes[table[i] - 1];
+    if (n.lhs == lhs && n.rhs == rhs) return &n;
+  }
+  return nullptr;
+}
+
+const node *mapped_node_arena::intern_local(
+    const node_or_leaf *,
+    const node_or_leaf *
+) {
+  assert(false && "mapped arenas are frozen");
+  std::abort();
+}
+
+indexed_string mapped_node_arena::string(size_t i) const {
+  const uint64_t *words = strings[i];
+  indexed_string string;
+  string.length = *words++;
+  string.trees.resize(2 * indexed_string::offset_of(string.length + 1));
+  for (const node_or_leaf *&tree : string.trees) {
+    tree = reinterpret_cast<const node_or_leaf *>(*words++);
+  }
+  return string;
+}
+
+void indexed_string::visit_trees(const tree_visitor &visitor) const {
+  auto tree = trees.begin();
+  // the left sides, then the right sides
+  for (int side = 0; side < 2; ++side) {
+    for (size_t sz = 0; sz <= length; ++sz) {
+      for (size_t bit = 0; bit < (size_t)std::bit_width(sz); ++bit) {
+        visitor(*tree++, bit);
+      }
+    }
+  }
+}
+
+void indexed_string::remap(node_promotion &promote) {
+  auto tree = trees.begin();
+  for (int side = 0; side < 2; ++side) {
+    for (size_t sz = 0; sz <= length; ++sz) {
+      for (size_t bit = 0; bit < (size_t)std::bit_width(sz); ++bit) {
+        *tree = promote(*tree, bit);
+        ++tree;
+      }
+    }
+  }
+}
+
+const node_or_leaf *lazy_indexed_string::tree(size_t bit, size_t idx) const {
+  if (!bit) return pyramid.front()[idx];
+  if (pyramid.size() <= bit) pyramid.resize(bit + 1);
+  nodes &level = pyramid[bit];
+  if (level.empty()) level.resize(size() - the_bit(bit) + 1, nullptr);
+  const node_or_leaf *&built = level[idx];
+  if (!built) {
+    // O(2^bit) the first time
+    size_t half = the_bit(bit - 1);
+    built = arena->intern(tree(bit - 1, idx), tree(bit - 1, idx + half));
+  }
+  return built;
+}
+
+lazy_indexed_string::split
+lazy_indexed_string::association(size_t on_right) const {
+  size_t on_left = size() - on_right;
+  size_t left_width = std::bit_width(on_left);
+  auto found = splits.find(on_right);
+  if (found == splits.end()) {
+    nodes trees(left_width + std::bit_width(on_right), nullptr);
+    // O(on_left) the first time
+    for (size_t bit = 0; bit < left_width; ++bit) {
+      if (on_left & the_bit(bit)) {
+        trees[bit] = tree(bit, on_left & (the_bit(bit) - 1));
+      }
+    }
+    // O(on_right) the first time
+    for (size_t bit = 0; the_bit(bit) <= on_right; ++bit) {
+      if (on_right & the_bit(bit)) {
+        size_t offset = on_right & (the_bit(bit) - 1);
+        trees[left_width + bit] = tree(bit, size() - the_bit(bit) - offset);
+      }
+    }
+    found = splits.emplace(on_right, std::move(trees)).first;
+  }
+  const nodes &trees = found->second;
+  return {
+      {trees.data(), left_width},
+      {trees.data() + left_width, trees.size() - left_width},
+  };
+}
+
+void lazy_indexed_string::visit_trees(const tree_visitor &visitor) const {
+  for (size_t bit = 0; bit < pyramid.size(); ++bit) {
+    for (const node_or_leaf *tree : pyramid[bit]) visitor(tree, bit);
+  }
+  for (const auto &[on_right, trees] : splits) {
+    size_t left_width = std::bit_width(size() - on_right);
+    for (size_t i = 0; i < trees.size(); ++i) {
+      visitor(trees[i], i < left_width ? i : i - left_width);
+    }
+  }
+}
+
+void lazy_indexed_string::remap(node_promotion &promote) {
+  for (size_t bit = 0; bit < pyramid.size(); ++bit) {
+    for (const node_or_leaf *&tree : pyramid[bit]) tree = promote(tree, bit);
+  }
+  for (auto &[on_right, trees] : splits) {
+    size_t left_width = std::bit_width(size() - on_right);
+    for (size_t i = 0; i < trees.size(); ++i) {
+      trees[i] = promote(trees[i], i < left_width ? i : i - left_width);
+    }
+  }
+}
+
+/** write the leaves of `itree`, of at most `tiny_size`, to `out` */
+static void tiny_leaves(const indexed_string &itree, const node_or_leaf **out) {
+  constexpr size_t tiny_size = tree_stack_base::tiny_size;
+  static_assert(tiny_size == 4, "unrolled for strings of up to 4");
+  // the string's trees by the bits of its size, the smallest first
+  indexed_string::tree_span trees = itree.association(itree.size()).right;
+  auto pair = [](const node_or_leaf *tree, const node_or_leaf **out) {
+    out[0] = static_cast<const node *>(tree)->lhs;
+    out[1] = static_cast<const node *>(tree)->rhs;
+  };
+  switch (itree.size()) {
+  case 4:
+    pair(static_cast<const node *>(trees[2])->lhs, out);
+    pair(static_cast<const node *>(trees[2])->rhs, out + 2);
+    break;
+  case 3:
+    pair(trees[1], out);
+    out[2] = trees[0];
+    break;
+  case 2:
+    pair(trees[1], out);
+    break;
+  case 1:
+    out[0] = trees[0];
+    break;
+  }
+}
+
 bool tree_stack_base::has_suffix(const indexed_string &itree) const {
-  if (_size < itree.size()) {
+  return has_suffix_of(itree);
+}
+bool tree_stack_base::has_suffix(const lazy_indexed_string &itree) const {
+  return has_suffix_of(itree);
+}
+
+bool tree_stack_base::has_suffix_subsumed(
+    const indexed_string &itree,
+    const leaf_relation &relation
+) const {
+  SUFFSTACK_COUNT(counters.has_suffix.calls, 1);
+  size_t string_size = itree.size();
+  if (_size < string_size) {
     return false;
   }
-  if (itree.empty()) {
+  size_t on_right = compute_association(_size, string_size);
+  size_t on_left = string_size - on_right;
+  indexed_string::split split = itree.association(on_right);
+
+  // the same descent as has_split_suffix, comparing trees under the
+  // relation rather than by pointer
+  for (size_t bits = on_right; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    if (!arena.subsumes(relation, trees[bit], split.right[bit], bit)) {
+      return false;
+    }
+  }
+  if (!on_left) {
     return true;
   }
 
-  size_t on_right = compute_association(_size, itree.size()); // O(1)
-  size_t on_left = itree.size() - on_right;
-  const indexed_string::split &split = itree.association(on_right); // O(1)
+  size_t borrowed_bit = std::countr_zero(_size - on_right);
+  const node_or_leaf *borrowed = trees[borrowed_bit];
+  size_t left_bit = split.left.size();
+  while (borrowed_bit > left_bit) {
+    borrowed = static_cast<const node *>(borrowed)->rhs;
+    SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+    --borrowed_bit;
+  }
+  for (; left_bit; --left_bit) {
+    const node *our_tree = static_cast<const node *>(borrowed);
+    SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+    if (on_left & the_bit(left_bit - 1)) {
+      const node_or_leaf *left_tree = split.left[left_bit - 1];
+      if (!arena.subsumes(relation, our_tree->rhs, left_tree, left_bit - 1)) {
+        return false;
+      }
+      borrowed = our_tree->lhs;
+    } else {
+      borrowed = our_tree->rhs;
+    }
+  }
+  return true;
+}
+
+bool tree_stack_base::has_split_suffix(
+    size_t string_size,
+    size_t on_right,
+    const indexed_string::split &split
+) const {
+  size_t on_left = string_size - on_right;
 
   // check right tree
   // O(log(on_right))
@@ -76,12 +888,14 @@ bool tree_stack_base::has_suffix(const indexed_string &itree) const {
   // O(log(size()))
   while (borrowed_bit > left_bit) {
     borrowed = static_cast<const node *>(borrowed)->rhs;
+    SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
     --borrowed_bit;
   }
   // O(log(on_left))
   for (; left_bit; --left_bit) {
     const node_or_leaf *left_tree = split.left[left_bit - 1];
     const node *our_tree = static_cast<const node *>(borrowed);
+    SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
     if (on_left & the_bit(left_bit - 1)) {
       if (our_tree->rhs != left_tree) {
         return false;
@@ -95,19 +909,120 @@ bool tree_stack_base::has_suffix(const indexed_string &itree) const {
   return true;
 }
 
+size_t tree_stack_base::match_suffixes(
+    candidate_span candidates,
+    std::vector<bool> *matches
+) const {
+  SUFFSTACK_COUNT(counters.has_suffix.calls, candidates.size());
+  // candidates which share an association share the descent down the
+  // borrowed tree, its right sides by height down to `path_bit`
+  tree_slots borrowed_path;
+  size_t path_on_right = std::numeric_limits<size_t>::max(), path_bit = 0;
+  // candidates which share a length also share every left tree they
+  // check, remembered for the last few lengths seen
+  struct length_checks {
+    size_t size = 0;
+    tree_slots left;
+  };
+  std::array<length_checks, 8> lengths;
+  size_t next_length = 0;
+
+  size_t first = candidates.size();
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    const indexed_string &itree = *candidates[i];
+    size_t size = itree.size();
+    if (size > _size) continue;
+    size_t on_right = compute_association(_size, size); // O(1)
+    size_t on_left = size - on_right;
+    indexed_string::split split = itree.association(on_right); // O(1)
+    if (on_left) {
+      auto checks = std::ranges::find(lengths, size, &length_checks::size);
+      if (checks == lengths.end()) {
+        checks = lengths.begin() + next_length++ % lengths.size();
+        checks->size = size;
+        if (path_on_right != on_right) {
+          path_on_right = on_right;
+          path_bit = std::countr_zero(_size - on_right);
+          borrowed_path[path_bit] = trees[path_bit];
+        }
+        size_t left_bits = std::bit_width(on_left);
+        // O(log(size())) in total for each association
+        for (; path_bit > left_bits; --path_bit) {
+          borrowed_path[path_bit - 1] =
+              static_cast<const node *>(borrowed_path[path_bit])->rhs;
+          SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+        }
+        // O(log(on_left)), once for each length
+        const node_or_leaf *borrowed = borrowed_path[left_bits];
+        for (size_t left_bit = left_bits; left_bit; --left_bit) {
+          const node *our_tree = static_cast<const node *>(borrowed);
+          SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+          checks->left[left_bit - 1] = our_tree->rhs;
+          bool set = on_left & the_bit(left_bit - 1);
+          borrowed = set ? our_tree->lhs : our_tree->rhs;
+        }
+      }
+      bool matched = true;
+      for (size_t bit = 0; matched && bit < split.left.size(); ++bit) {
+        matched = !(on_left & the_bit(bit)) ||
+                  split.left[bit] == checks->left[bit];
+      }
+      if (!matched) continue;
+    }
+    if (!std::equal(split.right.begin(), split.right.end(), trees.begin())) {
+      continue;
+    }
+    if (!matches) return i;
+    (*matches)[i] = true;
+    first = std::min(first, i);
+  }
+  return first;
+}
+
 void tree_stack_base::append(const indexed_string &itree) {
-  if (itree.empty()) {
+  size_t string_size = itree.size();
+  if (string_size > tiny_size) {
+    append_of(itree);
+    return;
+  }
+  SUFFSTACK_COUNT(counters.append.calls, 1);
+  if (!string_size) {
     return;
   }
+  size_t on_right = compute_association(_size + string_size, string_size);
+  append_split_within<std::bit_width(tiny_size)>(
+      string_size, on_right, itree.association(on_right)
+  );
+  push_tiny_window(itree);
+}
+void tree_stack_base::append(const lazy_indexed_string &itree) {
+  append_of(itree);
+}
+
+void tree_stack_base::push_leaf(const node_or_leaf *leaf) {
+  SUFFSTACK_COUNT(counters.append.calls, 1);
+  const node_or_leaf *constructing = leaf;
+  size_t bit_no = 0;
+  // O(1) amortized, as incrementing a binary counter
+  for (; _size & the_bit(bit_no); ++bit_no) {
+    constructing = arena.intern(trees[bit_no], constructing);
+    SUFFSTACK_COUNT(counters.append.intern_calls, 1);
+    trees[bit_no] = nullptr;
+  }
+  trees[bit_no] = constructing;
+  ++_size;
 
-  size_t new_size = _size + itree.size();
-  size_t on_right = compute_association(new_size, itree.size()); // O(1)
-  size_t on_left = itree.size() - on_right;
-  const indexed_string::split &split = itree.association(on_right); // O(1)
+  shift_window(1);
+  window.back() = leaf;
+}
 
-  // O(log(size() + itree.size()) - log(size()))
-  // = O(log(itree.size()/size()))
-  trees.resize(std::bit_width(new_size), nullptr);
+void tree_stack_base::append_split(
+    size_t string_size,
+    size_t on_right,
+    const indexed_string::split &split
+) {
+  size_t new_size = _size + string_size;
+  size_t on_left = string_size - on_right;
 
   if (on_left) {
     // a present bit in on_left indicates that split.left contains a
@@ -123,9 +1038,11 @@ void tree_stack_base::append(const indexed_string &itree) {
       bool supplied = on_left & the_bit(bit_no);
       if (supplied) {
         constructing = arena.intern(constructing, split.left[bit_no]);
+        SUFFSTACK_COUNT(counters.append.intern_calls, 1);
       } else {
         const node_or_leaf *&tr = trees[bit_no];
         constructing = arena.intern(tr, constructing);
+        SUFFSTACK_COUNT(counters.append.intern_calls, 1);
         tr = nullptr;
       }
     }
@@ -135,6 +1052,7 @@ void tree_stack_base::append(const indexed_string &itree) {
       const node_or_leaf *&lhs = trees[bit_no];
       if (!lhs) break;
       constructing = arena.intern(lhs, constructing);
+      SUFFSTACK_COUNT(counters.append.intern_calls, 1);
       lhs = nullptr;
       ++bit_no;
     }
@@ -160,7 +1078,78 @@ void tree_stack_base::append(const indexed_string &itree) {
   _size = new_size;
 }
 
+bool tree_stack_base::apply(
+    const indexed_string &params,
+    const indexed_string &results
+) {
+  SUFFSTACK_COUNT(counters.apply.calls, 1);
+  size_t string_size = params.size();
+  if (_size < string_size) {
+    return false;
+  }
+  size_t on_right = compute_association(_size, string_size);
+  size_t on_left = string_size - on_right;
+  indexed_string::split split = params.association(on_right);
+
+  // check right tree
+  // O(log(on_right))
+  if (!std::equal(split.right.begin(), split.right.end(), trees.begin())) {
+    return false;
+  }
+
+  // check the left tree while splitting off what remains of it, which
+  // is only kept once the whole suffix matched
+  tree_slots kept;
+  size_t kept_bits = 0, split_bit = 0;
+  if (on_left) {
+    split_bit = std::countr_zero(_size - on_right);
+    const node_or_leaf *splitting = trees[split_bit];
+    // the leaves of `splitting` still to be checked
+    size_t suffix = on_left;
+    // O(log(size()))
+    for (size_t bit_no = split_bit; bit_no--;) {
+      size_t bit = the_bit(bit_no);
+      const node *branch = static_cast<const node *>(splitting);
+      SUFFSTACK_COUNT(counters.apply.descents, 1);
+      if (suffix & bit) {
+        if (branch->rhs != split.left[bit_no]) {
+          return false;
+        }
+        suffix -= bit;
+        if (!suffix) {
+          kept[bit_no] = branch->lhs;
+          kept_bits |= bit;
+          break;
+        }
+        splitting = branch->lhs;
+      } else {
+        kept[bit_no] = branch->lhs;
+        kept_bits |= bit;
+        splitting = branch->rhs;
+      }
+    }
+  }
+
+  // truncate, O(log(on_right)) + O(log(on_left))
+  for (size_t right = on_right; right; right &= right - 1) {
+    trees[std::countr_zero(right)] = nullptr;
+  }
+  if (on_left) {
+    trees[split_bit] = nullptr;
+    for (size_t bits = kept_bits; bits; bits &= bits - 1) {
+      size_t bit_no = std::countr_zero(bits);
+      trees[bit_no] = kept[bit_no];
+    }
+  }
+  pop_window(string_size);
+  _size -= string_size;
+
+  append(results);
+  return true;
+}
+
 void tree_stack_base::truncate(size_t new_size) {
+  SUFFSTACK_COUNT(counters.truncate.calls, 1);
   size_t to_remove = _size - new_size;
 
   size_t on_right = compute_association(_size, to_remove);
@@ -173,7 +1162,8 @@ void tree_stack_base::truncate(size_t new_size) {
   while (right_iter) {
     unsigned step = std::countr_zero(right_iter);
     my_iter += step;
-    assert(*my_iter);
+    // not `*my_iter`, a leaf hidden in a pointer may well be null
+    assert(_size & the_bit(my_iter - trees.begin()));
     *my_iter = nullptr;
     my_iter++;
     right_iter >>= step + 1;
@@ -191,6 +1181,7 @@ void tree_stack_base::truncate(size_t new_size) {
     for (; bit; --bit_no, bit >>= 1) {
       bool keeping = to_remain & bit;
       const node *branch = static_cast<const node *>(splitting);
+      SUFFSTACK_COUNT(counters.truncate.descents, 1);
       if (keeping) {
         trees[bit_no] = branch->lhs;
         splitting = branch->rhs;
@@ -200,20 +1191,298 @@ void tree_stack_base::truncate(size_t new_size) {
     }
   }
 
+  pop_window(to_remove);
   _size = new_size;
-  trees.resize(std::bit_width(_size));
 }
 
-const node_or_leaf *const &tree_stack_base::back() const {
-  size_t bit = std::countr_zero(size());
+/** write the last `count` leaves of a tree of height `height` before
+    `out`, returning the first written */
+static const node_or_leaf **last_leaves(
+    const node_or_leaf *tree,
+    size_t height,
+    size_t count,
+    const node_or_leaf **out
+) {
+  // O(count + height)
+  for (; height; --height) {
+    const node *branch = static_cast<const node *>(tree);
+    size_t half = the_bit(height - 1);
+    if (count > half) {
+      out = last_leaves(branch->rhs, height - 1, half, out);
+      count -= half;
+      tree = branch->lhs;
+    } else {
+      tree = branch->rhs;
+    }
+  }
+  *--out = tree;
+  return out;
+}
+
+/** write the last `count` leaves of the trees of a stack or string of
+    size `size` before `out` */
+static void last_leaves(
+    size_t size,
+    std::span<const node_or_leaf *const> trees,
+    size_t count,
+    const node_or_leaf **out
+) {
+  for (size_t bit = 0; count; ++bit) {
+    if (!(size & the_bit(bit))) continue;
+    size_t taken = std::min(count, the_bit(bit));
+    out = last_leaves(trees[bit], bit, taken, out);
+    count -= taken;
+  }
+}
+
+void tree_stack_base::shift_window(size_t pushed) {
+  size_t kept = std::min(window_size, window.size() - pushed);
+  std::copy(window.end() - kept, window.end(), window.end() - kept - pushed);
+  window_size = kept + pushed;
+}
+
+void tree_stack_base::pop_window(size_t popped) {
+  size_t kept = window_size - std::min(window_size, popped);
+  auto first = window.end() - window_size;
+  std::copy_backward(first, first + kept, window.end());
+  window_size = kept;
+}
+
+void tree_stack_base::push_window(
+    size_t string_size,
+    indexed_string::tree_span trees
+) {
+  size_t pushed = std::min(string_size, window.size());
+  shift_window(pushed);
+  // O(pushed + log(string_size))
+  last_leaves(string_size, trees, pushed, window.data() + window.size());
+}
+
+void tree_stack_base::push_tiny_window(const indexed_string &itree) {
+  size_t pushed = itree.size();
+  shift_window(pushed);
+  tiny_leaves(itree, window.data() + (window.size() - pushed));
+}
+
+void tree_stack_base::refill_window() const {
+  size_t filled = std::min(_size, window.size());
+  std::array<const node_or_leaf *, window_capacity> leaves;
+  // O(window_capacity + log(size()))
+  last_leaves(_size, trees, filled, leaves.data() + leaves.size());
+  // only below the leaves already there, which may be referenced
+  std::copy(
+      leaves.end() - filled,
+      leaves.end() - window_size,
+      window.end() - filled
+  );
+  window_size = filled;
+}
+
+void tree_stack_base::for_each_leaf_block(
+    const std::function<void(leaf_span)> &visitor
+) const {
+  for_each_leaf_block(0, _size, visitor);
+}
+
+void tree_stack_base::for_each_leaf_block(
+    size_t from,
+    size_t to,
+    const std::function<void(leaf_span)> &visitor
+) const {
+  assert(from <= to && to <= _size);
+  std::array<const node_or_leaf *, 256> block;
+  size_t filled = 0;
+  // the trees still to visit, the next on top, with their heights and
+  // the index of their first leaf
+  constexpr size_t most_pending = std::tuple_size_v<tree_slots> + 1;
+  std::array<const node_or_leaf *, most_pending> pending;
+  std::array<size_t, most_pending> heights, starts;
+  // the largest tree is at the bottom
+  size_t start = 0;
+  for (size_t bits = _size; bits && start < to;) {
+    size_t bit = std::bit_width(bits) - 1;
+    bits -= the_bit(bit);
+    size_t tree_start = start;
+    start += the_bit(bit);
+    // O(log(size())) to skip the trees below `from`
+    if (start <= from) continue;
+    size_t depth = 0;
+    pending[depth] = trees[bit];
+    heights[depth] = bit;
+    starts[depth++] = tree_start;
+    // O(to - from + bit) in total
+    while (depth) {
+      --depth;
+      const node_or_leaf *tree = pending[depth];
+      size_t height = heights[depth], first = starts[depth];
+      size_t last = first + the_bit(height);
+      if (last <= from || to <= first) continue;
+      if (!height) {
+        block[filled++] = tree;
+      } else if (height == 1 && from <= first && last <= to) {
+        const node *pair = static_cast<const node *>(tree);
+        block[filled++] = pair->lhs;
+        block[filled++] = pair->rhs;
+      } else {
+        const node *branch = static_cast<const node *>(tree);
+        size_t half = the_bit(height - 1);
+        pending[depth] = branch->rhs;
+        heights[depth] = height - 1;
+        starts[depth++] = first + half;
+        pending[depth] = branch->lhs;
+        heights[depth] = height - 1;
+        starts[depth++] = first;
+      }
+      if (block.size() - filled < 2) {
+        visitor({block.data(), filled});
+        filled = 0;
+      }
+    }
+  }
+  if (filled) visitor({block.data(), filled});
+}
+
+const node_or_leaf *const &tree_stack_base::at(size_t index) const {
+  assert(index < _size);
+  // the largest tree is at the bottom
+  size_t bit = std::bit_width(_size) - 1;
+  for (; index >= the_bit(bit) || !(_size & the_bit(bit)); --bit) {
+    if (_size & the_bit(bit)) index -= the_bit(bit);
+  }
   node_or_leaf const *const *tree = &trees[bit];
-  // O(log(size())) worst case
+  // O(log(size()))
   for (; bit; --bit) {
-    tree = &static_cast<const node *>(*tree)->rhs;
+    const node &branch = static_cast<const node &>(**tree);
+    tree = index & the_bit(bit - 1) ? &branch.rhs : &branch.lhs;
   }
   return *tree;
 }
 
+namespace {
+/** trees covering the leaves of a stack from the top down, splitting
+    trees as they are needed in smaller pieces */
+struct leaf_frontier {
+  // the tree nearest the top last
+  std::array<const node_or_leaf *, 2 * std::tuple_size_v<tree_slots>> trees;
+  std::array<size_t, 2 * std::tuple_size_v<tree_slots>> heights;
+  size_t depth = 0;
+
+  void push(const node_or_leaf *tree, size_t height) {
+    trees[depth] = tree;
+    heights[depth++] = height;
+  }
+  void split() {
+    --depth;
+    const node *branch = static_cast<const node *>(trees[depth]);
+    size_t height = heights[depth];
+    push(branch->lhs, height - 1);
+    push(branch->rhs, height - 1);
+  }
+};
+} // namespace
+
+size_t tree_stack_base::longest_common_suffix(const tree_stack_base &o) const {
+  leaf_frontier ours, theirs;
+  for (size_t bit = std::bit_width(_size); bit--;) {
+    if (_size & the_bit(bit)) ours.push(trees[bit], bit);
+  }
+  for (size_t bit = std::bit_width(o._size); bit--;) {
+    if (o._size & the_bit(bit)) theirs.push(o.trees[bit], bit);
+  }
+  size_t common = 0;
+  while (ours.depth && theirs.depth) {
+    size_t our_height = ours.heights[ours.depth - 1];
+    size_t their_height = theirs.heights[theirs.depth - 1];
+    if (our_height == their_height) {
+      if (ours.trees[ours.depth - 1] == theirs.trees[theirs.depth - 1]) {
+        // interned, so the same leaves
+        common += the_bit(our_height);
+        --ours.depth;
+        --theirs.depth;
+        continue;
+      }
+      if (!our_height) break;
+      ours.split();
+      theirs.split();
+    } else if (our_height > their_height) {
+      ours.split();
+    } else {
+      theirs.split();
+    }
+  }
+  return common;
+}
+
+const node_or_leaf *const &tree_stack_base::back() const {
+  if (!window_size) refill_window();
+  return window.back();
+}
+
+tree_stack_base::leaf_span tree_stack_base::peek(size_t k) const {
+  assert(k <= window.size() && k <= _size);
+  if (window_size < k) refill_window();
+  return {window.data() + (window.size() - k), k};
+}
+
+/** whether the occupied trees of stacks of size `size` are the same */
+static bool
+same_trees(const tree_slots &lhs, const tree_slots &rhs, size_t size) {
+  for (size_t bits = size; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    if (lhs[bit] != rhs[bit]) return false;
+  }
+  return true;
+}
+
+/** a hash of the occupied trees of a stack of size `size` */
+static size_t hash_trees(const tree_slots &trees, size_t size) {
+  uint64_t hash = mix_bits(size);
+  for (size_t bits = size; bits; bits &= bits - 1) {
+    hash = mix_bits(hash ^ (uintptr_t)trees[std::countr_zero(bits)]);
+  }
+  return (size_t)hash;
+}
+
+size_t tree_stack_base::hash() const { return hash_trees(trees, _size); }
+
+size_t stack_snapshot::hash() const { return hash_trees(trees, _size); }
+
+bool tree_stack_base::operator==(const tree_stack_base &o) const {
+  return _size == o._size && same_trees(trees, o.trees, _size);
+}
+
+bool stack_snapshot::operator==(const stack_snapshot &o) const {
+  return _size == o._size && same_trees(trees, o.trees, _size);
+}
+
+void stack_snapshot::visit_trees(const tree_visitor &visitor) const {
+  for (size_t bits = _size; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    visitor(trees[bit], bit);
+  }
+}
+
+void stack_snapshot::remap(node_promotion &promote) {
+  for (size_t bits = _size; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    trees[bit] = promote(trees[bit], bit);
+  }
+}
+
+void tree_stack_base::visit_trees(const tree_visitor &visitor) const {
+  for (size_t bits = _size; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    visitor(trees[bit], bit);
+  }
+}
+
+void tree_stack_base::remap(node_promotion &promote) {
+  for (size_t bits = _size; bits; bits &= bits - 1) {
+    size_t bit = std::countr_zero(bits);
+    trees[bit] = promote(trees[bit], bit);
+  }
+}
+
 void node::iterator::move(difference_type by) {
   if (by == 0) {
     return;
@@ -263,7 +1532,7 @@ node::iterator &node::iterator::operator+=(difference_type delta) {
 }
 node::iterator node::iterator::operator--(int) {
   iterator cp = *this;
-  ++*this;
+  --*this;
   return cp;
 }
 node::iterator &node::iterator::operator--() {
@@ -281,8 +1550,6 @@ node::iterator &node::iterator::operator++() {
 }
 node::iterator::iterator(size_t bit, const node_or_leaf *root, size_t idx)
     : bit(bit), idx(idx) {
-  stack.resize(bit + 1);
-  stack.shrink_to_fit();
   stack[bit] = root;
   resolve_from(bit);
 }
@@ -294,7 +1561,7 @@ tree_stack_base::r_iterator::r_iterator(const tree_stack_base *tree, bool end)
     over = true;
     return;
   }
-  bit = end ? tree->trees.size() - 1 : std::countr_zero(size);
+  bit = end ? std::bit_width(size) - 1 : std::countr_zero(size);
   nodes = {bit, owner->trees[bit], end ? 0 : the_bit(bit) - 1};
   over = end;
   if (end) {
@@ -318,7 +1585,7 @@ tree_stack_base::r_iterator &tree_stack_base::r_iterator::operator++() {
 }
 tree_stack_base::r_iterator tree_stack_base::r_iterator::operator++(int) {
   r_iterator cp = *this;
-  ++cp;
+  ++*this;
   return cp;
 }
 bool tree_stack_base::r_iterator::operator==(const r_iterator &o) const {
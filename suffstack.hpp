@@ -1,14 +1,54 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iterator>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <thread>
 #include <type_traits>
+#include <typeindex>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+/** whether arenas keep track of the stacks and strings using them, to
+    check that nodes are no longer in use when they are rolled back.
+    This changes the layout of arenas, stacks and strings, so must be
+    the same for every translation unit, which is why it is set
+    explicitly, as CMake's `SUFFSTACK_CHECK_ROLLBACK` option does for
+    the library and its users, rather than following `NDEBUG` */
+#ifndef SUFFSTACK_CHECK_ROLLBACK
+#define SUFFSTACK_CHECK_ROLLBACK 0
+#endif
+
+/** whether arenas and stacks count what they do, for `stats()`; when
+    not set the counters and counting compile to nothing. This changes
+    the layout of arenas and stacks, so must be the same for every
+    translation unit */
+#ifndef SUFFSTACK_STATS
+#define SUFFSTACK_STATS 0
+#endif
+
+/** add `n` to the statistics counter `counter` if `SUFFSTACK_STATS` */
+#if SUFFSTACK_STATS
+#define SUFFSTACK_COUNT(counter, n) ((counter) += (n))
+#else
+#define SUFFSTACK_COUNT(counter, n) ((void)0)
+#endif
+
 /**
  * The suffix stack is a stack data structure based on interned full
  * binary trees.
@@ -45,11 +85,54 @@
  */
 namespace suffstack {
 
-/** abstract interface for a stack as we need it */
+/** concept for a stack as we need it, for validators templated on
+    their stack so that its operations are called directly and can be
+    inlined; see `suffix_stack` to choose the stack at run time */
+template <typename Stack>
+concept suffix_stack_like = requires(
+    Stack &stack,
+    const Stack &cstack,
+    const typename Stack::string_type &str,
+    size_t size
+) {
+  { cstack.has_suffix(str) } -> std::same_as<bool>;
+  stack.append(str);
+  stack.truncate(size);
+  stack.pop(size);
+  {
+    cstack.back()
+  } -> std::convertible_to<const typename Stack::value_type &>;
+  { cstack.size() } -> std::same_as<size_t>;
+  { cstack.empty() } -> std::same_as<bool>;
+};
+
+/** base for implementations of `suffix_stack_like`, with the types it
+    needs and the operations which follow from the others, called on
+    `Derived` without virtual calls */
+template <typename Derived, typename StringType, typename ValueType>
+struct static_suffix_stack {
+  using string_type = StringType;
+  using value_type = ValueType;
+
+  void pop(size_t count) {
+    size_t size = self().size();
+    self().truncate(count > size ? 0 : size - count);
+  }
+  bool empty() const { return self().size() == 0; }
+
+private:
+  Derived &self() { return static_cast<Derived &>(*this); }
+  const Derived &self() const { return static_cast<const Derived &>(*this); }
+};
+
+/** abstract interface for a stack as we need it, for choosing the stack
+    at run time; wrap a `suffix_stack_like` in `virtual_stack` for one */
 template <typename StringType, typename ValueType> struct suffix_stack {
   using string_type = StringType;
   using value_type = ValueType;
 
+  virtual ~suffix_stack() = default;
+
   virtual bool has_suffix(const string_type &itree) const = 0;
   virtual void append(const string_type &itree) = 0;
   virtual void truncate(size_t size) = 0;
@@ -60,33 +143,56 @@ template <typename StringType, typename ValueType> struct suffix_stack {
   virtual bool empty() const = 0;
 };
 
+/** a `suffix_stack` forwarding to `stack`, an indirect call for each
+    operation */
+template <suffix_stack_like Stack>
+struct virtual_stack final
+    : suffix_stack<typename Stack::string_type, typename Stack::value_type> {
+  using string_type = typename Stack::string_type;
+  using value_type = typename Stack::value_type;
+  Stack stack;
+
+  template <typename... Args>
+    requires std::constructible_from<Stack, Args...>
+  explicit virtual_stack(Args &&...args)
+      : stack(std::forward<Args>(args)...) {}
+
+  bool has_suffix(const string_type &str) const override {
+    return stack.has_suffix(str);
+  }
+  void append(const string_type &str) override { stack.append(str); }
+  void truncate(size_t size) override { stack.truncate(size); }
+  void pop(size_t count) override { stack.pop(count); }
+  const value_type &back() const override { return stack.back(); }
+
+  size_t size() const override { return stack.size(); }
+  bool empty() const override { return stack.empty(); }
+};
+
 /** naive implementation of the stack interface we need */
-template <typename T> struct naive_stack : suffix_stack<std::vector<T>, T> {
+template <typename T>
+struct naive_stack
+    : static_suffix_stack<naive_stack<T>, std::vector<T>, T> {
   using string = std::vector<T>;
   string values;
 
   // O(suff.size())
-  bool has_suffix(const string &suff) const override {
+  bool has_suffix(const string &suff) const {
     if (suff.size() > values.size()) return false;
     return std::equal(suff.rbegin(), suff.rend(), values.rbegin());
   }
   // O(suff.size()) amortized
-  void append(const string &suff) override {
+  void append(const string &suff) {
     values.reserve(values.size() + suff.size());
     std::copy(suff.begin(), suff.end(), std::back_inserter(values));
   }
   // O(1)
-  void truncate(size_t count) override { values.resize(count); }
+  void truncate(size_t count) { values.resize(count); }
   // O(1)
-  void pop(size_t count) override {
-    truncate(count > size() ? 0 : size() - count);
-  }
-  // O(1)
-  const T &back() const override { return values.back(); }
+  const T &back() const { return values.back(); }
 
   // O(1)
-  size_t size() const override { return values.size(); }
-  bool empty() const override { return size() == 0; }
+  size_t size() const { return values.size(); }
 
   auto rbegin() const { return values.rbegin(); }
   auto rend() const { return values.rend(); }
@@ -118,7 +224,10 @@ struct node : public node_or_leaf {
 
   struct iterator {
     size_t bit, idx;
-    std::vector<const node_or_leaf *> stack;
+    // the path from the leaf at `idx` up to the root, inline since a
+    // tree is at most as tall as a size has bits
+    std::array<const node_or_leaf *, std::numeric_limits<size_t>::digits + 1>
+        stack;
     bool over = false;
 
     iterator() : iterator(0, nullptr) {}
@@ -158,62 +267,955 @@ struct node : public node_or_leaf {
       "must be a bidirectional iterator"
   );
 };
-} // namespace suffstack
 
-namespace std {
-using namespace suffstack;
-/** hash implementation for nodes, for interning in constant time */
-template <> struct hash<node> {
+/** the original multiplicative hash of a node, kept as a baseline for
+    benchmarks; many nodes share a hash with it, though probes are
+    about as long as with `mixing_node_hash`, since table indices are
+    taken from a Fibonacci hash of it */
+struct legacy_node_hash {
   size_t operator()(const node &node) const {
     return (size_t)node.lhs * 27 + (size_t)node.rhs;
   }
 };
+
+/** murmur3's 64-bit finalizer, every input bit affects every output
+    bit */
+constexpr uint64_t mix_bits(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+/** the default hash of a node, which mixes both children so that
+    aligned, clustered pointers and small hidden leaves are spread
+    over the whole range; this barely changes probe lengths, but
+    makes distinct nodes' hashes differ, which tables compare before
+    the children, so probes read no other nodes */
+struct mixing_node_hash {
+  size_t operator()(const node &node) const {
+    uint64_t lhs = (uintptr_t)node.lhs, rhs = (uintptr_t)node.rhs;
+    return (size_t)mix_bits(std::rotl(lhs, 32) * 0x9e3779b97f4a7c15ull ^ rhs);
+  }
+};
+} // namespace suffstack
+
+namespace std {
+using namespace suffstack;
+/** hash implementation for nodes, for interning in constant time */
+template <> struct hash<node> : mixing_node_hash {};
 } // namespace std
 
 namespace suffstack {
 
-/** an arena for holding interned nodes */
-struct node_arena {
-  node_arena *parent;
-  std::unordered_set<node> nodes;
+/** callback for each tree held by a stack or string, with the tree's
+    height; trees of height 0 are leaves */
+using tree_visitor = std::function<void(const node_or_leaf *, size_t)>;
+
+struct node_arena_base;
+
+#if SUFFSTACK_CHECK_ROLLBACK
+/** registers a stack or string with its arena and the arena's
+    ancestors, so that they can check that nodes being discarded are
+    no longer in use */
+struct arena_registration {
+  using visit_fn = void (*)(const arena_registration &, const tree_visitor &);
+
+  visit_fn visit;
+  node_arena_base *arena = nullptr;
+
+  arena_registration(visit_fn visit, node_arena_base *arena)
+      : visit(visit) {
+    track(arena);
+  }
+  arena_registration(const arena_registration &o) : visit(o.visit) {
+    track(o.arena);
+  }
+  arena_registration &operator=(const arena_registration &o) {
+    if (this != &o) track(o.arena);
+    return *this;
+  }
+  ~arena_registration() { track(nullptr); }
+
+  /** move this registration to `arena`, which may be null */
+  void track(node_arena_base *arena);
+};
+
+/** base for types registered with `arena_registration`, `Owner` must
+    have `void visit_trees(const tree_visitor &) const` */
+template <typename Owner> struct arena_tracked : arena_registration {
+  arena_tracked(node_arena_base *arena = nullptr)
+      : arena_registration(&visit_owner, arena) {}
+
+private:
+  static void
+  visit_owner(const arena_registration &reg, const tree_visitor &visitor) {
+    static_cast<const Owner &>(static_cast<const arena_tracked &>(reg))
+        .visit_trees(visitor);
+  }
+};
+#else
+template <typename Owner> struct arena_tracked {
+  arena_tracked(node_arena_base * = nullptr) {}
+  void track(node_arena_base *) {}
+};
+#endif
+
+/** a relation between leaves, such as subtyping, under which trees are
+    compared leaf by leaf; it must be reflexive, so that trees which
+    are the same can be skipped. Comparisons are memoized by arenas
+    under the relation's `id`, which no other relation is ever given,
+    even after this one is destroyed */
+struct leaf_relation {
+  std::function<bool(const node_or_leaf *ours, const node_or_leaf *theirs)>
+      related;
+  const uint64_t id;
+
+  leaf_relation(decltype(related) related)
+      : related(std::move(related)), id(next_id()) {}
+  leaf_relation(const leaf_relation &) = delete;
+  leaf_relation &operator=(const leaf_relation &) = delete;
+
+private:
+  static uint64_t next_id();
+};
+
+/** a statistics counter, which may be counted by many threads */
+struct stat_counter {
+  std::atomic<size_t> value{0};
+
+  stat_counter &operator+=(size_t n) {
+    value.fetch_add(n, std::memory_order_relaxed);
+    return *this;
+  }
+  size_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+/** a snapshot of what an arena has done, see `SUFFSTACK_STATS`; the
+    counts are zero when it isn't set */
+struct arena_stats {
+  /** calls to `intern` */
+  size_t interns = 0;
+  /** interns which found the node already in the arena or, for
+      `parent_hits`, in an ancestor */
+  size_t hits = 0, parent_hits = 0;
+  /** interns which created a node */
+  size_t misses = 0;
+  /** nodes held by the arena, the bytes held for them and their table,
+      and how full that table is; zero for arenas that don't say */
+  size_t nodes = 0, bytes = 0;
+  double load_factor = 0;
+};
+
+/** interface for an arena holding interned nodes; nodes interned in
+    an arena keep their address for the lifetime of the arena */
+struct node_arena_base {
+  /** an arena searched (read-only) before interning new nodes here */
+  node_arena_base *parent;
+
+#if SUFFSTACK_CHECK_ROLLBACK
+  /** stacks and strings using this arena or one of its descendants */
+  std::unordered_set<const arena_registration *> registrations;
+  mutable std::mutex registrations_mutex;
+
+  /** asserts that no registered stack or string holds a node for
+      which `discarded` holds */
+  void
+  check_unreferenced(const std::function<bool(const node *)> &discarded
+  ) const;
+#endif
 
-  node_arena(node_arena *parent = nullptr) : parent(parent) {}
+  node_arena_base(node_arena_base *parent = nullptr)
+      : parent(parent), leaves_id(next_leaves_id()) {}
+  node_arena_base(const node_arena_base &) = delete;
+  node_arena_base &operator=(const node_arena_base &) = delete;
+  virtual ~node_arena_base() = default;
+
+  /** find a node interned in this arena, ignoring the parent;
+      returns nullptr if there is no such node */
+  virtual const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const = 0;
+  /** intern a node in this arena, ignoring the parent */
+  virtual const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) = 0;
+
+  /** find a node interned in this arena or any of its ancestors */
+  const node *find(const node_or_leaf *lhs, const node_or_leaf *rhs) const {
+    for (const node_arena_base *a = this; a; a = a->parent) {
+      const node *found = a->find_local(lhs, rhs);
+      if (found) return found;
+    }
+    return nullptr;
+  }
 
+  /** intern a node, reusing it from the nearest ancestor that has it */
   const node *intern(const node_or_leaf *lhs, const node_or_leaf *rhs) {
-    node to_intern(lhs, rhs);
+    SUFFSTACK_COUNT(counters.interns, 1);
     if (parent) {
-      auto found = parent->nodes.find(to_intern);
-      if (found != parent->nodes.end()) return &*found;
+      const node *found = parent->find(lhs, rhs);
+      if (found) {
+        SUFFSTACK_COUNT(counters.parent_hits, 1);
+        return found;
+      }
+    }
+    return intern_local(lhs, rhs);
+  }
+
+  /** what this arena has done since it was made, O(1) */
+  virtual arena_stats stats() const {
+    arena_stats stats;
+#if SUFFSTACK_STATS
+    stats.interns = counters.interns.load();
+    stats.parent_hits = counters.parent_hits.load();
+    stats.misses = counters.misses.load();
+    stats.hits = stats.interns - stats.misses;
+#endif
+    return stats;
+  }
+
+  /** intern `value` as a leaf, so that equal values are the same leaf;
+      leaves are kept by the root arena, so they are shared by all its
+      descendants and outlive their nodes, and may be interned from
+      several threads, which only contend for the same shard of the
+      values of `T` */
+  template <typename T> const leaf_base *intern_leaf(const T &value) {
+    leaf_table<T> &table = leaves_of<T>();
+    auto &shard = table.shards[mix_bits(std::hash<T>()(value)) %
+                               leaf_table<T>::shard_count];
+    std::lock_guard lock(shard.mutex);
+    return reinterpret_cast<const leaf_base *>(
+        &*shard.values.insert(value).first
+    );
+  }
+
+  /** whether each leaf of `ours` is related to that of `theirs` under
+      `relation`, both being trees of height `height`; comparisons of
+      nodes are memoized, so comparing the same nodes again is O(1) */
+  bool subsumes(
+      const leaf_relation &relation,
+      const node_or_leaf *ours,
+      const node_or_leaf *theirs,
+      size_t height
+  );
+
+protected:
+  /** forget memoized comparisons, before nodes of this arena are
+      discarded and their addresses reused; descendants forget theirs
+      on their next comparison */
+  void forget_subsumptions();
+
+#if SUFFSTACK_STATS
+  /** counts for `stats`, misses are counted by `intern_local` */
+  struct arena_counters {
+    stat_counter interns, parent_hits, misses;
+  } counters;
+#endif
+
+private:
+  struct subsumption {
+    uint64_t relation;
+    const node_or_leaf *ours, *theirs;
+    bool operator==(const subsumption &) const = default;
+  };
+  struct subsumption_hash {
+    size_t operator()(const subsumption &s) const {
+      uint64_t hash = mix_bits(s.relation);
+      hash = mix_bits(hash ^ (uintptr_t)s.ours);
+      return (size_t)mix_bits(hash ^ (uintptr_t)s.theirs);
+    }
+  };
+  std::unordered_map<subsumption, bool, subsumption_hash> subsumptions;
+  std::mutex subsumptions_mutex;
+  // times this arena has discarded nodes, and the total over it and
+  // its ancestors when `subsumptions` was last valid, since it holds
+  // their nodes too
+  std::atomic<size_t> discards{0};
+  size_t subsumptions_discards = 0;
+  /** the count of discards of this arena and its ancestors */
+  size_t lineage_discards() const;
+
+  struct any_leaf_table {
+    virtual ~any_leaf_table() = default;
+  };
+  template <typename T> struct leaf_table : any_leaf_table {
+    static constexpr size_t shard_count = 16;
+    struct shard {
+      std::mutex mutex;
+      // nodes of the set keep their address
+      std::unordered_set<T> values;
+    };
+    std::array<shard, shard_count> shards;
+  };
+  // identifies the leaf tables of this arena, if it is a root, to the
+  // tables cached by threads; ids are never reused
+  const uint64_t leaves_id;
+  std::unordered_map<std::type_index, std::unique_ptr<any_leaf_table>>
+      leaf_tables;
+  std::mutex leaves_mutex;
+
+  static uint64_t next_leaves_id();
+  /** the root's table of leaves of `T`, looked up under the root's
+      lock only if the thread last used another root's */
+  template <typename T> leaf_table<T> &leaves_of() {
+    node_arena_base *root = this;
+    while (root->parent) root = root->parent;
+    thread_local struct {
+      uint64_t root_id = 0;
+      leaf_table<T> *table = nullptr;
+    } cached;
+    if (cached.table && cached.root_id == root->leaves_id) {
+      return *cached.table;
+    }
+    std::lock_guard lock(root->leaves_mutex);
+    std::unique_ptr<any_leaf_table> &table = root->leaf_tables[typeid(T)];
+    if (!table) table = std::make_unique<leaf_table<T>>();
+    cached = {root->leaves_id, static_cast<leaf_table<T> *>(table.get())};
+    return *cached.table;
+  }
+};
+
+/**
+ * Promotes the nodes of an arena into its parent, typically merging a
+ * thread's own arena into a shared, otherwise frozen, parent at a sync
+ * point. Nodes are promoted by remapping every tree that refers to
+ * them, after which the child arena can be cleared.
+ *
+ * Remapping rules:
+ * - leaves (trees of height 0) are never touched, leaves hidden in
+ *   pointers can't be told apart from nodes otherwise;
+ * - nodes found in an ancestor of the child are kept, as they cannot
+ *   refer to the child's nodes;
+ * - nodes of the child are replaced, children first, by interning
+ *   them in the parent (or reusing the parent's or any ancestor's).
+ *
+ * Only nodes reachable from a remapped tree are promoted. The parent
+ * is written to, so promotions into anything but a concurrent arena
+ * must not race with each other or with lookups in the parent.
+ */
+struct node_promotion {
+  const node_arena_base &from;
+  node_arena_base &into;
+
+  node_promotion(const node_arena_base &from)
+      : from(from), into(*from.parent) {}
+
+  /** returns the replacement of a tree of the given height;
+      O(nodes of the tree local to `from`), memoised */
+  const node_or_leaf *operator()(const node_or_leaf *tree, size_t height);
+
+  /** number of nodes interned into the parent */
+  size_t size() const { return promoted.size(); }
+
+private:
+  std::unordered_map<const node *, const node *> promoted;
+};
+
+/** an arena holding interned nodes in a `std::unordered_set`, with
+    one heap allocation per node */
+template <typename Hash = std::hash<node>>
+struct basic_unordered_node_arena : node_arena_base {
+  std::unordered_set<node, Hash> nodes;
+
+  using node_arena_base::node_arena_base;
+
+  const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const override {
+    auto found = nodes.find(node(lhs, rhs));
+    return found == nodes.end() ? nullptr : &*found;
+  }
+  const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) override {
+    auto [interned, created] = nodes.emplace(lhs, rhs);
+    SUFFSTACK_COUNT(counters.misses, created);
+    return &*interned;
+  }
+
+  /** as the base's, with the bytes of the set's nodes and buckets,
+      estimated as a node and two pointers each and a pointer each */
+  arena_stats stats() const override {
+    arena_stats stats = node_arena_base::stats();
+    stats.nodes = nodes.size();
+    stats.bytes = nodes.size() * (sizeof(node) + 2 * sizeof(void *)) +
+                  nodes.bucket_count() * sizeof(void *);
+    stats.load_factor = nodes.load_factor();
+    return stats;
+  }
+
+  /** drop every node, e.g. after they have been promoted */
+  void clear() {
+    forget_subsumptions();
+    nodes.clear();
+  }
+};
+using unordered_node_arena = basic_unordered_node_arena<>;
+
+/** bump allocator for nodes, in contiguous slabs which are never
+    moved, and freed only on `clear`; freed nodes are reused */
+struct node_slabs {
+  /** number of nodes in each slab */
+  static constexpr size_t slab_size = 1024;
+
+  /** enough to undo every allocation made since */
+  struct position {
+    size_t used, reused;
+  };
+
+  node *allocate(const node_or_leaf *lhs, const node_or_leaf *rhs);
+  /** make `n` available for reuse, this invalidates every position */
+  void free(node *n);
+
+  /** number of nodes ever allocated from the slabs */
+  size_t size() const { return used; }
+  /** number of nodes currently allocated */
+  size_t live() const { return used - (freed.size() - reused); }
+  /** the `idx`th node allocated from the slabs */
+  node *operator[](size_t idx) const {
+    return slabs[idx / slab_size].get() + idx % slab_size;
+  }
+  /** the index of `n` in the slabs, or `size()` if `n` isn't in the
+      slabs; O(log(slabs)) */
+  size_t index_of(const node *n) const;
+
+  position tell() const { return {used, reused}; }
+  /** whether `n` was allocated since `pos`; O(log(slabs)), or
+      O(reused nodes) for freed nodes */
+  bool allocated_since(position pos, const node *n) const;
+  /** undo every allocation since `pos`, passing each node to `undo`
+      before it is dropped */
+  template <typename F> void rewind(position pos, F &&undo) {
+    for (size_t idx = used; idx-- > pos.used;) undo((*this)[idx]);
+    for (size_t idx = reused; idx-- > pos.reused;) {
+      undo(freed[freed.size() - 1 - idx]);
+    }
+    used = pos.used;
+    reused = pos.reused;
+  }
+
+  /** bytes held by the slabs and the free list */
+  size_t reserved_bytes() const {
+    return slabs.size() * slab_size * sizeof(node) +
+           freed.capacity() * sizeof(node *);
+  }
+  void clear();
+
+private:
+  struct slab_deleter {
+    void operator()(node *slab) const { ::operator delete(slab); }
+  };
+
+  std::vector<std::unique_ptr<node, slab_deleter>> slabs;
+  /** (start, index) of each slab, by address */
+  std::vector<std::pair<const node *, size_t>> by_address;
+  size_t used = 0;
+  /** freed nodes, reused from the back; the last `reused` are in use
+      again, but kept here so they can be rewound */
+  std::vector<node *> freed;
+  size_t reused = 0;
+};
+
+/** statistics of an open-addressing intern table */
+struct probe_stats {
+  size_t entries = 0, capacity = 0;
+  /** sum and maximum of the probes needed to find each entry */
+  size_t total_probes = 0, max_probe = 0;
+  /** entries not stored in the slot their hash maps to */
+  size_t displaced = 0;
+  /** entries sharing their full hash with another entry */
+  size_t hash_collisions = 0;
+
+  double mean_probe() const {
+    return entries ? (double)total_probes / entries : 0;
+  }
+  double collision_rate() const {
+    return entries ? (double)displaced / entries : 0;
+  }
+};
+
+/** an arena holding interned nodes in contiguous, bump-allocated
+    slabs, and an open-addressing (linear probing) table of pointers
+    into the slabs for interning; `Hash` hashes a `node` */
+template <typename Hash = std::hash<node>>
+struct basic_node_arena : node_arena_base {
+  basic_node_arena(node_arena_base *parent = nullptr)
+      : node_arena_base(parent) {}
+
+  const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const override {
+    if (table.empty()) return nullptr;
+    size_t hash = hasher(node(lhs, rhs));
+    // O(1) expected, the table is at most half full
+    for (size_t i = index_of(hash);; i = next(i)) {
+      const slot &s = table[i];
+      if (!s.value) return nullptr;
+      if (s.hash == hash && s.value->lhs == lhs && s.value->rhs == rhs) {
+        return s.value;
+      }
+    }
+  }
+  const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) override {
+    if ((count + 1) * 2 > table.size()) grow();
+    size_t hash = hasher(node(lhs, rhs));
+    size_t i = index_of(hash);
+    for (;; i = next(i)) {
+      const slot &s = table[i];
+      if (!s.value) break;
+      if (s.hash == hash && s.value->lhs == lhs && s.value->rhs == rhs) {
+        return s.value;
+      }
+    }
+    const node *created = slabs.allocate(lhs, rhs);
+    table[i] = {hash, created};
+    ++count;
+    SUFFSTACK_COUNT(counters.misses, 1);
+    return created;
+  }
+
+  /** number of nodes interned in this arena */
+  size_t size() const { return count; }
+  /** bytes held by this arena for its nodes and table */
+  size_t reserved_bytes() const {
+    return slabs.reserved_bytes() + table.capacity() * sizeof(slot);
+  }
+  arena_stats stats() const override {
+    arena_stats stats = node_arena_base::stats();
+    stats.nodes = count;
+    stats.bytes = reserved_bytes();
+    stats.load_factor = table.empty() ? 0 : (double)count / table.size();
+    return stats;
+  }
+
+  /** drop every node, e.g. after they have been promoted */
+  void clear() {
+#if SUFFSTACK_CHECK_ROLLBACK
+    check_unreferenced([&](const node *n) {
+      return slabs.index_of(n) != slabs.size();
+    });
+#endif
+    forget_subsumptions();
+    slabs.clear();
+    table.clear();
+    table_bits = 0;
+    count = 0;
+    ++collections;
+  }
+
+  /** a point in the history of the arena, to roll back to */
+  struct mark {
+    node_slabs::position position;
+    size_t collections;
+  };
+
+  /** O(1) */
+  mark checkpoint() const { return {slabs.tell(), collections}; }
+
+  /** drop every node interned since `to` was taken; no stack or
+      string may still hold these nodes, which is checked if
+      `SUFFSTACK_CHECK_ROLLBACK` is set. Marks taken after `to`, and
+      marks taken before a `collect` or `clear`, are invalid.
+      O(nodes dropped) */
+  void rollback(mark to) {
+    assert(to.collections == collections && "the mark was invalidated");
+#if SUFFSTACK_CHECK_ROLLBACK
+    check_unreferenced([&](const node *n) {
+      return slabs.allocated_since(to.position, n);
+    });
+#endif
+    forget_subsumptions();
+    slabs.rewind(to.position, [&](const node *n) { erase(n); });
+    count = slabs.live();
+  }
+
+  /** callback which passes each root to the visitor it is given */
+  using root_set = std::function<void(const tree_visitor &)>;
+
+  /**
+   * Mark-sweep garbage collection: free every node of this arena not
+   * reachable from a tree of `roots`, to be reused by later interning.
+   * Every stack and string using this arena must be included in the
+   * roots, or hold none of its nodes, and so must any descendant
+   * arena's nodes. This invalidates every mark.
+   *
+   * O(size() + freed nodes) time, and one bit per node.
+   *
+   * Returns the number of nodes freed.
+   */
+  size_t collect(const root_set &roots) {
+    std::vector<bool> reachable(slabs.size());
+    roots([&](const node_or_leaf *tree, size_t height) {
+      mark_reachable(reachable, tree, height);
+    });
+    size_t freed = 0;
+    forget_subsumptions();
+    for (size_t idx = 0; idx < slabs.size(); ++idx) {
+      if (reachable[idx]) continue;
+      node *n = slabs[idx];
+      if (find_local(n->lhs, n->rhs) != n) continue; // already free
+      erase(n);
+      slabs.free(n);
+      ++freed;
+    }
+    count = slabs.live();
+    ++collections;
+    return freed;
+  }
+  /** collect with the trees of the given stacks and strings, and
+      anything else with `visit_trees`, as roots */
+  template <typename... Roots> size_t collect_from(const Roots &...roots) {
+    return collect([&](const tree_visitor &visitor) {
+      (roots.visit_trees(visitor), ...);
+    });
+  }
+
+  /** O(size() log size()) */
+  probe_stats table_stats() const {
+    probe_stats stats;
+    stats.entries = count;
+    stats.capacity = table.size();
+    std::vector<size_t> hashes;
+    hashes.reserve(count);
+    for (size_t i = 0; i < table.size(); ++i) {
+      if (!table[i].value) continue;
+      size_t probe = ((i - index_of(table[i].hash)) & (table.size() - 1)) + 1;
+      stats.total_probes += probe;
+      stats.max_probe = std::max(stats.max_probe, probe);
+      stats.displaced += probe != 1;
+      hashes.push_back(table[i].hash);
+    }
+    std::sort(hashes.begin(), hashes.end());
+    for (size_t i = 0; i < hashes.size();) {
+      size_t j = i + 1;
+      while (j < hashes.size() && hashes[j] == hashes[i]) ++j;
+      if (j - i > 1) stats.hash_collisions += j - i;
+      i = j;
+    }
+    return stats;
+  }
+
+private:
+  struct slot {
+    size_t hash;
+    const node *value;
+  };
+
+  [[no_unique_address]] Hash hasher;
+  node_slabs slabs;
+  size_t count = 0;
+  /** number of times nodes were freed other than by rollback */
+  size_t collections = 0;
+  /** power of two sized, at most half full */
+  std::vector<slot> table;
+  /** width of a table index, the top bits of the hash are used */
+  unsigned table_bits = 0;
+
+  size_t index_of(size_t hash) const {
+    // Fibonacci hashing, so that the top bits of the hash are mixed in
+    return (hash * 0x9e3779b97f4a7c15ull) >>
+           (std::numeric_limits<size_t>::digits - table_bits);
+  }
+  size_t next(size_t i) const { return (i + 1) & (table.size() - 1); }
+
+  void mark_reachable(
+      std::vector<bool> &reachable,
+      const node_or_leaf *tree,
+      size_t height
+  ) const {
+    // O(height) deep
+    for (; height && tree; --height) {
+      const node *n = static_cast<const node *>(tree);
+      size_t idx = slabs.index_of(n);
+      // nodes of ancestors can't refer to ours
+      if (idx == slabs.size() || reachable[idx]) return;
+      reachable[idx] = true;
+      mark_reachable(reachable, n->lhs, height - 1);
+      tree = n->rhs;
+    }
+  }
+
+  /** remove `n` from the table, shifting back the entries after it */
+  void erase(const node *n) {
+    size_t hole = index_of(hasher(*n));
+    while (table[hole].value != n) hole = next(hole);
+    for (size_t i = next(hole); table[i].value; i = next(i)) {
+      size_t home = index_of(table[i].hash);
+      // the entry can fill the hole if its home isn't in (hole, i]
+      bool movable = hole < i ? home <= hole || home > i
+                              : home <= hole && home > i;
+      if (movable) {
+        table[hole] = table[i];
+        hole = i;
+      }
+    }
+    table[hole] = {0, nullptr};
+  }
+
+  void grow() {
+    std::vector<slot> old = std::move(table);
+    table_bits = table_bits ? table_bits + 1 : 6;
+    table.assign(the_bit(table_bits), {0, nullptr});
+    // O(count), amortised O(1) per intern
+    for (const slot &s : old) {
+      if (!s.value) continue;
+      size_t i = index_of(s.hash);
+      while (table[i].value) i = next(i);
+      table[i] = s;
+    }
+  }
+};
+using node_arena = basic_node_arena<>;
+
+/** a node in a `concurrent_node_arena`, chained to the next node of
+    its bucket; both fields are written before the node is published
+    and never change afterwards */
+struct chained_node : node {
+  size_t hash;
+  const chained_node *next;
+
+  chained_node(const node_or_leaf *lhs, const node_or_leaf *rhs, size_t hash)
+      : node(lhs, rhs), hash(hash), next(nullptr) {}
+};
+
+/** lock-free bump allocator for chained nodes, slabs are never moved
+    or freed until destruction */
+struct concurrent_node_slabs {
+  /** number of nodes in each slab */
+  static constexpr size_t slab_size = 1024;
+
+  concurrent_node_slabs() = default;
+  concurrent_node_slabs(const concurrent_node_slabs &) = delete;
+  ~concurrent_node_slabs();
+
+  chained_node *
+  allocate(const node_or_leaf *lhs, const node_or_leaf *rhs, size_t hash);
+
+private:
+  struct slab;
+
+  std::atomic<slab *> current{nullptr};
+};
+
+/** an arena which may be interned into from many threads at once;
+    lookup is lock-free, and insertion publishes a new node with a
+    compare-and-swap on the head of its bucket's chain, so all threads
+    agree on a single address for each node.
+
+    The bucket count is fixed at construction, so there is no default:
+    pass `bucket_bits_for` the number of nodes expected, beyond which
+    chains grow linearly, e.g. to 16 nodes on average at 16 times it. */
+template <typename Hash = std::hash<node>>
+struct basic_concurrent_node_arena : node_arena_base {
+  /** with `the_bit(bucket_bits)` buckets, for `bucket_bits` from 1 to
+      one less than the bits of `size_t` */
+  basic_concurrent_node_arena(node_arena_base *parent, unsigned bucket_bits)
+      : node_arena_base(parent), bucket_bits(bucket_bits),
+        buckets(new std::atomic<const chained_node *>[the_bit(bucket_bits)]) {
+    assert(
+        bucket_bits > 0 && bucket_bits < std::numeric_limits<size_t>::digits
+    );
+    for (size_t i = 0; i < the_bit(bucket_bits); ++i) {
+      buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const override {
+    size_t hash = hasher(node(lhs, rhs));
+    const chained_node *head =
+        buckets[index_of(hash)].load(std::memory_order_acquire);
+    return find_in(head, nullptr, hash, lhs, rhs);
+  }
+  const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) override {
+    size_t hash = hasher(node(lhs, rhs));
+    std::atomic<const chained_node *> &bucket = buckets[index_of(hash)];
+    const chained_node *head = bucket.load(std::memory_order_acquire);
+    const node *found = find_in(head, nullptr, hash, lhs, rhs);
+    if (found) return found;
+    chained_node *created = slabs.allocate(lhs, rhs, hash);
+    while (true) {
+      created->next = head;
+      if (bucket.compare_exchange_weak(
+              head,
+              created,
+              std::memory_order_release,
+              std::memory_order_acquire
+          )) {
+        count.fetch_add(1, std::memory_order_relaxed);
+        SUFFSTACK_COUNT(counters.misses, 1);
+        return created;
+      }
+      // only the nodes published since our last look need checking;
+      // if another thread won the race, `created` is left unused
+      found = find_in(head, created->next, hash, lhs, rhs);
+      if (found) return found;
+    }
+  }
+
+  /** the bucket bits for about one node per bucket with
+      `expected_nodes` nodes */
+  static constexpr unsigned bucket_bits_for(size_t expected_nodes) {
+    return std::max(1u, (unsigned)std::bit_width(expected_nodes));
+  }
+  /** number of nodes interned in this arena, approximate while other
+      threads are interning */
+  size_t size() const { return count.load(std::memory_order_relaxed); }
+  /** nodes per bucket for the load factor, bytes aren't counted */
+  arena_stats stats() const override {
+    arena_stats stats = node_arena_base::stats();
+    stats.nodes = size();
+    stats.load_factor = (double)stats.nodes / the_bit(bucket_bits);
+    return stats;
+  }
+
+private:
+  [[no_unique_address]] Hash hasher;
+  unsigned bucket_bits;
+  std::unique_ptr<std::atomic<const chained_node *>[]> buckets;
+  concurrent_node_slabs slabs;
+  std::atomic<size_t> count{0};
+
+  size_t index_of(size_t hash) const {
+    return (hash * 0x9e3779b97f4a7c15ull) >>
+           (std::numeric_limits<size_t>::digits - bucket_bits);
+  }
+  static const node *find_in(
+      const chained_node *from,
+      const chained_node *until,
+      size_t hash,
+      const node_or_leaf *lhs,
+      const node_or_leaf *rhs
+  ) {
+    for (; from != until; from = from->next) {
+      if (from->hash == hash && from->lhs == lhs && from->rhs == rhs) {
+        return from;
+      }
     }
-    return &*nodes.emplace(to_intern).first;
+    return nullptr;
   }
 };
+using concurrent_node_arena = basic_concurrent_node_arena<>;
+
+/** a fixed set of worker threads for splitting loops across; loops
+    are run by one thread at a time */
+struct thread_pool {
+  /** start `workers` threads, the caller of `parallel_for` also works */
+  explicit thread_pool(size_t workers);
+  thread_pool(const thread_pool &) = delete;
+  ~thread_pool();
+
+  /** number of threads running loops, including the caller's */
+  size_t size() const { return workers.size() + 1; }
+
+  /** run `body(begin, end)` over chunks of [0, count) of at least
+      `grain` iterations across the pool, returning once all are done */
+  void parallel_for(
+      size_t count,
+      size_t grain,
+      const std::function<void(size_t, size_t)> &body
+  );
+
+private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  bool stopping = false;
+  /** the current loop, set under `mutex` */
+  const std::function<void(size_t, size_t)> *body = nullptr;
+  size_t count = 0, chunk = 0, generation = 0, busy = 0;
+  std::atomic<size_t> next_chunk{0};
+
+  void run_chunks();
+  void work();
+};
+
+/** options for indexing a string across a thread pool, the arena
+    indexed into must allow concurrent interning, such as a
+    `concurrent_node_arena` */
+struct parallel_indexing {
+  thread_pool &pool;
+  /** strings shorter than this are indexed serially, and loops are
+      not split into chunks smaller than this */
+  size_t cutoff = 1 << 12;
+};
+
+/** scratch buffers for indexing strings, reusing them when indexing
+    many strings in a row keeps indexing from allocating once they are
+    large enough */
+struct index_workspace {
+  std::vector<const node_or_leaf *> paired, leaves;
+};
 
 /** a string indexed for use with a suffix tree, this stores every
-    split of the string, taking up O(N log N) space, and taking O(N
-    log N) time to index */
-struct indexed_string {
+    split of the string, taking up O(N log N) space in a single
+    buffer, and taking O(N log N) time to index */
+struct indexed_string : arena_tracked<indexed_string> {
   using leaves = std::vector<const leaf_base *>;
   using nodes = std::vector<const node_or_leaf *>;
+  /** a view of trees, the `i`th tree of which has `2^i` leaves or is
+      absent (null) */
+  using tree_span = std::span<const node_or_leaf *const>;
+  using leaf_span = std::span<const node_or_leaf *const>;
 
+  /** a split of the string, into trees of its leftmost leaves and
+      trees of its rightmost leaves, each smallest first */
   struct split {
-    nodes left, right;
+    tree_span left, right;
   };
-  std::vector<split> assocs;
 
   indexed_string() = default;
-  indexed_string(node_arena &f, const leaves &leaves) {
+  indexed_string(node_arena_base &f, const leaves &leaves) {
     index_from(f, {leaves.begin(), leaves.end()});
   }
-  indexed_string(const leaf_base *leaf) : assocs{{{}, {leaf}}, {{leaf}, {}}} {}
+  indexed_string(const leaf_base *leaf) : length(1), trees{leaf, leaf} {}
 
-  void index_from(node_arena &f, nodes &&leaves);
+  void index_from(node_arena_base &f, nodes &&leaves);
+  /** index `leaves` with each level split across a thread pool */
+  void index_from(
+      node_arena_base &f,
+      nodes &&leaves,
+      const parallel_indexing &parallel
+  );
+  /** index `leaves` reusing the buffers of this string and of
+      `workspace`, which doesn't allocate if they are large enough */
+  void
+  index_from(node_arena_base &f, leaf_span leaves, index_workspace &workspace);
+  /** replace the trees of this string with their promotions,
+      O(N log N) */
+  void remap(node_promotion &promote);
+  void visit_trees(const tree_visitor &visitor) const;
 
-  size_t size() const { return assocs.size() - 1; }
+  size_t size() const { return length; }
   bool empty() const { return size() == 0; }
-  const split &association(size_t on_right) const {
-    return assocs.rbegin()[on_right];
+  /** O(1) */
+  split association(size_t on_right) const {
+    size_t on_left = length - on_right;
+    return {
+        {trees.data() + offset_of(on_left), (size_t)std::bit_width(on_left)},
+        {trees.data() + offset_of(length + 1) + offset_of(on_right),
+         (size_t)std::bit_width(on_right)},
+    };
   }
+
+  /** the number of trees stored for the sides of splits with fewer
+      than `n` leaves, that is, `\sum_{k<n} bit_width(k)` */
+  static constexpr size_t offset_of(size_t n) {
+    if (!n) return 0;
+    size_t width = std::bit_width(n - 1);
+    return width * n - the_bit(width) + 1;
+  }
+
+private:
+  size_t length = 0;
+  /** the left sides of every split, by size, followed by the right
+      sides of every split, by size; O(N log N) of them */
+  nodes trees;
+
+  /** index the leaves in `paired`, which is used as scratch space */
+  void index_paired(node_arena_base &f, nodes &paired);
+
+  friend struct mapped_node_arena;
 };
 
 /** concept to mark something we can store in the `lhs` and `rhs`
@@ -240,22 +1242,361 @@ const T &find_in_pointer(const Pointee *const &ptr) {
   return reinterpret_cast<T const &>(ptr);
 }
 
+/** concept for values too large to hide in a pointer which can be
+    interned with `node_arena_base::intern_leaf` instead */
+template <typename T>
+concept can_intern_leaf =
+    std::copy_constructible<T> && std::equality_comparable<T> &&
+    requires(const T &t) {
+      { std::hash<T>()(t) } -> std::convertible_to<size_t>;
+    };
+
+/** concept for values which can be leaves of trees, hidden in
+    pointers if they fit, since that costs nothing, or interned */
+template <typename T>
+concept leaf_value = can_hide_in_pointer<T> || can_intern_leaf<T>;
+
+/** the leaf for `value`, interned in `f` if it can't be hidden */
+template <typename T>
+  requires leaf_value<T>
+const leaf_base *to_leaf(node_arena_base &f, const T &value) {
+  if constexpr (can_hide_in_pointer<T>) {
+    return hide_in_pointer<leaf_base>(value);
+  } else {
+    return f.intern_leaf(value);
+  }
+}
+/** recover the value from a leaf made with `to_leaf` */
+template <typename T>
+  requires leaf_value<T>
+const T &from_leaf(const node_or_leaf *const &leaf) {
+  if constexpr (can_hide_in_pointer<T>) {
+    return find_in_pointer<T>(leaf);
+  } else {
+    return *reinterpret_cast<const T *>(leaf);
+  }
+}
+
 /** an indexed string over a specific type, where leaves are stored
-    inline (hidden as pointers) at the ends of trees; this type is
-    only for convenience, and for `tree_stack`'s interface */
+    inline (hidden as pointers) at the ends of trees, or interned in
+    the arena if they don't fit; this type is only for convenience,
+    and for `tree_stack`'s interface */
 template <typename T>
-  requires can_hide_in_pointer<T>
+  requires leaf_value<T>
 struct indexed_string_over : indexed_string {
-  indexed_string_over(node_arena &f, const std::vector<T> &leaves) {
+  indexed_string_over(node_arena_base &f, const std::vector<T> &leaves) {
     nodes nodes;
     nodes.reserve(leaves.size());
     for (const T &leaf : leaves) {
-      nodes.push_back(hide_in_pointer<leaf_base>(leaf));
+      nodes.push_back(to_leaf(f, leaf));
     }
     index_from(f, std::move(nodes));
   }
+  indexed_string_over(
+      node_arena_base &f,
+      const std::vector<T> &leaves,
+      const parallel_indexing &parallel
+  ) {
+    nodes nodes;
+    nodes.reserve(leaves.size());
+    for (const T &leaf : leaves) {
+      nodes.push_back(to_leaf(f, leaf));
+    }
+    index_from(f, std::move(nodes), parallel);
+  }
   indexed_string_over(const T &t)
+    requires can_hide_in_pointer<T>
       : indexed_string(hide_in_pointer<leaf_base>(t)) {}
+  indexed_string_over(node_arena_base &f, const T &t)
+      : indexed_string(to_leaf(f, t)) {}
+  /** adopt `untyped`, whose leaves must have been made from `T`s, such
+      as a string from `mapped_node_arena::string` */
+  explicit indexed_string_over(indexed_string &&untyped)
+      : indexed_string(std::move(untyped)) {}
+  indexed_string_over() = default;
+
+  using indexed_string::index_from;
+  /** index `values`, see `indexed_string::index_from` with a workspace */
+  void index_from(
+      node_arena_base &f,
+      const std::vector<T> &values,
+      index_workspace &workspace
+  ) {
+    workspace.leaves.clear();
+    for (const T &value : values) {
+      workspace.leaves.push_back(to_leaf(f, value));
+    }
+    indexed_string::index_from(f, workspace.leaves, workspace);
+  }
+};
+
+/** an indexed string which only builds the splits that are asked for,
+    for strings that are rarely checked.
+
+    The trees of 2^b consecutive leaves are interned on demand and
+    kept, so building a split is O(N) interns the first time it is
+    asked for, less if its trees were already built for another, and
+    O(1) after that. Building every split is the same O(N log N) as in
+    `indexed_string`. Building splits mutates the string, so it may
+    not be shared between threads. */
+struct lazy_indexed_string : arena_tracked<lazy_indexed_string> {
+  using nodes = indexed_string::nodes;
+  using split = indexed_string::split;
+
+  lazy_indexed_string(node_arena_base &f, nodes &&leaves)
+      : arena_tracked(&f), arena(&f) {
+    // not `pyramid{std::move(leaves)}`, which copies the leaves out of
+    // an initializer list
+    pyramid.emplace_back(std::move(leaves));
+  }
+
+  size_t size() const { return pyramid.front().size(); }
+  bool empty() const { return size() == 0; }
+  split association(size_t on_right) const;
+
+  void remap(node_promotion &promote);
+  void visit_trees(const tree_visitor &visitor) const;
+
+private:
+  node_arena_base *arena;
+  /** `pyramid[b][i]` is the tree of the 2^b leaves from the `i`th, or
+      null if it isn't built yet; levels are allocated on demand */
+  mutable std::vector<nodes> pyramid;
+  /** the left trees then the right trees of each split built so far,
+      by the number of leaves on the right */
+  mutable std::unordered_map<size_t, nodes> splits;
+
+  const node_or_leaf *tree(size_t bit, size_t idx) const;
+};
+
+/** a lazy indexed string over a specific type, see
+    `indexed_string_over` */
+template <typename T>
+  requires leaf_value<T>
+struct lazy_indexed_string_over : lazy_indexed_string {
+  lazy_indexed_string_over(node_arena_base &f, const std::vector<T> &leaves)
+      : lazy_indexed_string(f, to_leaves(f, leaves)) {}
+
+private:
+  static nodes to_leaves(node_arena_base &f, const std::vector<T> &leaves) {
+    nodes nodes;
+    nodes.reserve(leaves.size());
+    for (const T &leaf : leaves) {
+      nodes.push_back(to_leaf(f, leaf));
+    }
+    return nodes;
+  }
+};
+
+/** a cache of indexed strings bound to an arena, keyed by their
+    leaves, for strings that are checked over and over, such as the
+    types of functions. At most `capacity` strings are kept, the least
+    recently used is evicted first. Cached strings are shared and
+    immutable, and stay valid while they are held even if evicted. */
+struct indexed_string_cache {
+  using nodes = indexed_string::nodes;
+  using leaf_span = std::span<const node_or_leaf *const>;
+
+  node_arena_base &arena;
+  size_t capacity;
+
+  indexed_string_cache(node_arena_base &arena, size_t capacity)
+      : arena(arena), capacity(capacity) {}
+  indexed_string_cache(const indexed_string_cache &) = delete;
+
+  /** the string of these (hidden) leaves, indexing it on a miss;
+      O(leaves.size()) on a hit */
+  std::shared_ptr<const indexed_string> get(leaf_span leaves) {
+    return get(leaves, [&]() {
+      auto string = std::make_shared<indexed_string>();
+      string->index_from(arena, nodes(leaves.begin(), leaves.end()));
+      return string;
+    });
+  }
+
+  size_t size() const { return entries.size(); }
+  size_t hits() const { return hit_count; }
+  size_t misses() const { return miss_count; }
+  double hit_rate() const {
+    size_t total = hits() + misses();
+    return total ? (double)hits() / total : 0;
+  }
+
+  /** evict every string, e.g. before rolling back the arena */
+  void clear() {
+    by_leaves.clear();
+    entries.clear();
+  }
+  /** the cached strings, as roots for `node_arena::collect` */
+  void visit_trees(const tree_visitor &visitor) const {
+    for (const entry &e : entries) e.string->visit_trees(visitor);
+  }
+
+protected:
+  /** get the string for `leaves`, or cache and return that of `make()`
+      if there is none */
+  template <typename Make>
+  std::shared_ptr<const indexed_string> get(leaf_span leaves, Make &&make) {
+    auto found = by_leaves.find(leaves);
+    if (found != by_leaves.end()) {
+      ++hit_count;
+      // move to the front, O(1)
+      entries.splice(entries.begin(), entries, found->second);
+      return found->second->string;
+    }
+    ++miss_count;
+    std::shared_ptr<const indexed_string> string = make();
+    if (!capacity) return string;
+    if (entries.size() == capacity) {
+      by_leaves.erase(leaf_span(entries.back().leaves));
+      entries.pop_back();
+    }
+    entries.push_front({{leaves.begin(), leaves.end()}, string});
+    by_leaves.emplace(leaf_span(entries.front().leaves), entries.begin());
+    return string;
+  }
+
+private:
+  struct entry {
+    nodes leaves;
+    std::shared_ptr<const indexed_string> string;
+  };
+  struct leaves_hash {
+    size_t operator()(leaf_span leaves) const {
+      uint64_t hash = leaves.size();
+      for (const node_or_leaf *leaf : leaves) {
+        hash = mix_bits(hash ^ (uintptr_t)leaf);
+      }
+      return (size_t)hash;
+    }
+  };
+  struct leaves_equal {
+    bool operator()(leaf_span lhs, leaf_span rhs) const {
+      return std::ranges::equal(lhs, rhs);
+    }
+  };
+
+  /** most recently used first */
+  std::list<entry> entries;
+  /** keyed by views of the leaves of `entries` */
+  std::unordered_map<
+      leaf_span,
+      std::list<entry>::iterator,
+      leaves_hash,
+      leaves_equal>
+      by_leaves;
+  size_t hit_count = 0, miss_count = 0;
+};
+
+/** an indexed string cache over a specific type, see
+    `indexed_string_over` */
+template <typename T>
+  requires leaf_value<T>
+struct indexed_string_cache_over : indexed_string_cache {
+  using indexed_string_cache::indexed_string_cache;
+
+  std::shared_ptr<const indexed_string_over<T>>
+  get(const std::vector<T> &values) {
+    scratch.clear();
+    for (const T &value : values) {
+      scratch.push_back(to_leaf(arena, value));
+    }
+    // every string in this cache is made here
+    return std::static_pointer_cast<const indexed_string_over<T>>(
+        indexed_string_cache::get(scratch, [&]() {
+          return std::make_shared<const indexed_string_over<T>>(arena, values);
+        })
+    );
+  }
+
+private:
+  nodes scratch;
+};
+
+/**
+ * A frozen arena read from an image of some indexed strings and every
+ * node they refer to, for loading strings without indexing them again;
+ * typically the image is mapped from a file and used as the parent of
+ * the arenas of each stack.
+ *
+ * References to nodes are stored as absolute pointers, prelinked for
+ * a preferred base address chosen by the writer, since stacks follow
+ * the children of nodes directly and can't add a base to them. So the
+ * image is not position-independent: only one mapped at exactly its
+ * preferred base, e.g. read-only with `MAP_FIXED_NOREPLACE`, is used
+ * in place without copying, its pages shared between processes. An
+ * image anywhere else is copied, relocated and its table rebuilt when
+ * loaded, O(image.size()), and shares nothing.
+ *
+ * Leaves are stored as they are, so images may only hold leaves hidden
+ * in pointers, not interned ones.
+ *
+ * Image layout, in native 64-bit words:
+ * - a header, see `image_header`;
+ * - the nodes, those with leaves as children first;
+ * - a table of node indices plus one, or 0 for none, probed linearly
+ *   from the Fibonacci hash of the node;
+ * - for each string, its length followed by its trees.
+ */
+struct mapped_node_arena : node_arena_base {
+  struct image_header {
+    char magic[8];
+    uint64_t version;
+    uint64_t preferred_base;
+    uint64_t size;
+    uint64_t node_count;
+    /** the number of nodes whose children are leaves */
+    uint64_t leaf_parents;
+    uint64_t table_bits;
+    uint64_t string_count;
+  };
+  static constexpr char magic[8] = {'S', 'U', 'F', 'F', 'S', 'T', 'K', 0};
+  static constexpr uint64_t version = 1;
+
+  /** write an image of `strings`, to be loaded at `preferred_base` */
+  static std::vector<uint64_t> write_image(
+      std::span<const indexed_string *const> strings,
+      uintptr_t preferred_base
+  );
+
+  /** whether `image` is a whole image of this version, every
+      reference in it to a node of the image of the right height, so
+      that it can be loaded; O(image.size()) */
+  static bool valid(std::span<const uint64_t> image);
+  /** use the image at `image`, which must stay valid and unchanged for
+      the lifetime of the arena if it is at its preferred base, or null
+      if it is not `valid`, e.g. a truncated or stale file; a copy is
+      made of an image anywhere else. O(image.size()) either way, to
+      validate it */
+  static std::unique_ptr<mapped_node_arena>
+  load(std::span<const uint64_t> image, node_arena_base *parent = nullptr);
+
+  const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const override;
+  /** mapped arenas are frozen, this must not be called */
+  const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) override;
+
+  /** whether the image had to be copied to relocate it */
+  bool relocated() const { return !copy.empty(); }
+  /** number of nodes in the image */
+  size_t size() const { return header->node_count; }
+  size_t string_count() const { return header->string_count; }
+  /** the `i`th string of the image, in the order they were written;
+      copies its trees rather than indexing it, O(N log N) */
+  indexed_string string(size_t i) const;
+
+private:
+  /** requires `valid(image)`, as checked by `load` */
+  mapped_node_arena(std::span<const uint64_t> image, node_arena_base *parent);
+
+  /** the relocated copy of the image, if not at its preferred base */
+  std::vector<uint64_t> copy;
+  const image_header *header;
+  const node *nodes;
+  const uint64_t *table;
+  /** where each string starts */
+  std::vector<const uint64_t *> strings;
 };
 
 /** returns the association required to compare a tree of size
@@ -272,24 +1613,463 @@ constexpr size_t compute_association(size_t tree_size, size_t string_size) {
   }
 }
 
+/** an indexed string of values fixed at compile time, such as the
+    parameters of an instruction. Its nodes are interned when it is
+    constructed, once for each arena it is used with, while the
+    associations it needs for every size of stack are computed at
+    compile time, so `tree_stack` can check, append and apply it with
+    its loops over the string's trees unrolled */
+template <typename T, T... values>
+  requires can_hide_in_pointer<T>
+struct static_indexed_string : indexed_string_over<T> {
+  static constexpr size_t length = sizeof...(values);
+  static constexpr std::array<T, length> leaves{values...};
+  /** the number of bits of the sizes of the string's splits */
+  static constexpr size_t width = std::bit_width(length);
+
+  explicit static_indexed_string(node_arena_base &f)
+      : indexed_string_over<T>(f, {leaves.begin(), leaves.end()}) {}
+
+  /** `compute_association(stack_size, length)`, looked up; O(1) */
+  static constexpr size_t association_of(size_t stack_size) {
+    return associations[stack_size & (the_bit(width) - 1)];
+  }
+
+private:
+  // compute_association only looks at the low `width` bits of the
+  // stack's size
+  static constexpr std::array<size_t, the_bit(width)> associations = [] {
+    std::array<size_t, the_bit(width)> on_right;
+    for (size_t low = 0; low < on_right.size(); ++low) {
+      on_right[low] = compute_association(low, length);
+    }
+    return on_right;
+  }();
+};
+
+/** counts of one kind of operation on a stack */
+struct stack_op_stats {
+  size_t calls = 0;
+  /** steps from a node of the stack's trees down to one of its
+      children */
+  size_t descents = 0;
+  /** calls to `node_arena_base::intern`, whether or not the arena
+      already had the node; a stack can't tell which calls created one,
+      the arena counts those as its `arena_stats::misses` */
+  size_t intern_calls = 0;
+};
+
+/** a snapshot of what a stack has done, see `SUFFSTACK_STATS`; zero
+    when it isn't set. The operations of `has_suffix_any` and its kin
+    count as a `has_suffix` for each candidate, and an `apply` counts
+    as an `append` of its results too */
+struct stack_stats {
+  stack_op_stats has_suffix, append, truncate, apply;
+};
+
+/** a tree for each bit of a size, smallest first */
+using tree_slots =
+    std::array<const node_or_leaf *, std::numeric_limits<size_t>::digits>;
+
+/** the trees of a tree stack at some point, to restore it to later;
+    the nodes are those of the stack's arena, so a snapshot must be
+    remapped along with the stack if the arena's nodes are promoted */
+struct stack_snapshot : arena_tracked<stack_snapshot> {
+  stack_snapshot(node_arena_base &arena, const tree_slots &trees, size_t size)
+      : arena_tracked(&arena), trees(trees), _size(size) {}
+
+  size_t size() const { return _size; }
+  /** whether the snapshots are of the same contents; O(log(size())) */
+  bool operator==(const stack_snapshot &o) const;
+  /** a hash of the contents, the same as the stack's; O(log(size())) */
+  size_t hash() const;
+  void remap(node_promotion &promote);
+  void visit_trees(const tree_visitor &visitor) const;
+
+private:
+  friend struct tree_stack_base;
+  tree_slots trees;
+  size_t _size;
+};
+
 /** type-erased implementation of the tree stack */
-struct tree_stack_base {
+struct tree_stack_base : arena_tracked<tree_stack_base> {
   using nodes = indexed_string::nodes;
+  using leaf_span = indexed_string::leaf_span;
+  using candidate_span = std::span<const indexed_string *const>;
+  /** the number of leaves at the top kept for `back` and `peek` */
+  static constexpr size_t window_capacity = 8;
+  /** the longest strings given their own path through `append`, which
+      are most strings in practice; `has_suffix` and `truncate` take
+      the generic path for them, where a special one measured no
+      faster */
+  static constexpr size_t tiny_size = 4;
+
+protected:
+  node_arena_base &arena;
 
 private:
-  node_arena &arena;
-  // smallest tree first
-  nodes trees;
+  // defined by the tests, to compare the path for tiny strings against
+  // the generic one
+  friend struct tiny_append_baseline;
+
+  // smallest tree first, a tree for each set bit of `_size` and null
+  // for the rest
+  tree_slots trees{};
   size_t _size = 0;
+  // the top `window_size` leaves at its end, the top last, so that the
+  // top stays in the last slot while it is on the stack; kept as
+  // strings are appended and popped, and refilled once too many are
+  // popped, only ever below the leaves still there
+  mutable std::array<const node_or_leaf *, window_capacity> window;
+  mutable size_t window_size = 0;
+#if SUFFSTACK_STATS
+  // counted by const operations too
+  mutable stack_stats counters;
+#endif
+
+  template <typename String> bool has_suffix_of(const String &itree) const {
+    SUFFSTACK_COUNT(counters.has_suffix.calls, 1);
+    if (_size < itree.size()) {
+      return false;
+    }
+    if (itree.empty()) {
+      return true;
+    }
+    size_t on_right = compute_association(_size, itree.size()); // O(1)
+    return has_split_suffix(
+        itree.size(), on_right, itree.association(on_right) // O(1)
+    );
+  }
+  template <typename String> void append_of(const String &itree) {
+    SUFFSTACK_COUNT(counters.append.calls, 1);
+    if (itree.empty()) {
+      return;
+    }
+    size_t on_right = compute_association(_size + itree.size(), itree.size());
+    append_split(itree.size(), on_right, itree.association(on_right));
+    if constexpr (std::is_same_v<String, indexed_string>) {
+      // O(1) to split entirely on the right
+      push_window(itree.size(), itree.association(itree.size()).right);
+    } else {
+      // which could build a split for nothing
+      window_size = 0;
+    }
+  }
+  /** add the leaves of a string of size `string_size` to the window,
+      given the trees of each bit of its size, smallest first */
+  void push_window(size_t string_size, indexed_string::tree_span trees);
+  /** move the leaves of the window down to make room for `pushed` */
+  void shift_window(size_t pushed);
+  /** drop the top `popped` leaves of the window, moving the rest up */
+  void pop_window(size_t popped);
+  void refill_window() const;
+  /** push the leaves of a string of at most `tiny_size` to the window */
+  void push_tiny_window(const indexed_string &itree);
+  /** check the suffix of size `string_size`, split as `split` with
+      `on_right` leaves on the right */
+  bool has_split_suffix(
+      size_t string_size,
+      size_t on_right,
+      const indexed_string::split &split
+  ) const;
+  void append_split(
+      size_t string_size,
+      size_t on_right,
+      const indexed_string::split &split
+  );
+  /** `has_split_suffix` for strings whose splits have fewer than
+      `width` bits, looping over their trees a bit at a time so the
+      loops unroll */
+  template <size_t width>
+  bool has_split_suffix_within(
+      size_t string_size,
+      size_t on_right,
+      const indexed_string::split &split
+  ) const {
+    size_t on_left = string_size - on_right;
+    for (size_t bit = 0; bit < width; ++bit) {
+      if ((on_right & the_bit(bit)) && trees[bit] != split.right[bit]) {
+        return false;
+      }
+    }
+    if (!on_left) {
+      return true;
+    }
+
+    size_t borrowed_bit = std::countr_zero(_size - on_right);
+    const node_or_leaf *borrowed = trees[borrowed_bit];
+    // O(log(size()))
+    for (; borrowed_bit > width; --borrowed_bit) {
+      borrowed = static_cast<const node *>(borrowed)->rhs;
+      SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+    }
+    for (size_t left_bit = width; left_bit; --left_bit) {
+      if (left_bit > borrowed_bit) continue;
+      const node *our_tree = static_cast<const node *>(borrowed);
+      SUFFSTACK_COUNT(counters.has_suffix.descents, 1);
+      if (on_left & the_bit(left_bit - 1)) {
+        if (our_tree->rhs != split.left[left_bit - 1]) {
+          return false;
+        }
+        borrowed = our_tree->lhs;
+      } else {
+        borrowed = our_tree->rhs;
+      }
+    }
+    return true;
+  }
+  /** `append_split` for strings whose splits have fewer than `width`
+      bits, combining trees in loops of `width` until the carry runs
+      past the string's bits */
+  template <size_t width>
+  void append_split_within(
+      size_t string_size,
+      size_t on_right,
+      const indexed_string::split &split
+  ) {
+    size_t on_left = string_size - on_right;
+    if (on_left) {
+      size_t bit_no = std::countr_zero(on_left);
+      const node_or_leaf *constructing = trees[bit_no];
+      trees[bit_no] = nullptr;
+      for (size_t bit = 0; bit < width; ++bit) {
+        if (bit < bit_no || the_bit(bit) > on_left) continue;
+        if (on_left & the_bit(bit)) {
+          constructing = arena.intern(constructing, split.left[bit]);
+          SUFFSTACK_COUNT(counters.append.intern_calls, 1);
+        } else {
+          constructing = arena.intern(trees[bit], constructing);
+          SUFFSTACK_COUNT(counters.append.intern_calls, 1);
+          trees[bit] = nullptr;
+        }
+      }
+      // O(log(size()/string_size))
+      for (bit_no = std::bit_width(on_left); trees[bit_no]; ++bit_no) {
+        constructing = arena.intern(trees[bit_no], constructing);
+        SUFFSTACK_COUNT(counters.append.intern_calls, 1);
+        trees[bit_no] = nullptr;
+      }
+      trees[bit_no] = constructing;
+    }
+    for (size_t bit = 0; bit < width; ++bit) {
+      if (on_right & the_bit(bit)) {
+        assert(!trees[bit]);
+        trees[bit] = split.right[bit];
+      }
+    }
+    _size += string_size;
+  }
+  /** check each of `candidates`, setting `matches` if given, or else
+      returning the index of the first suffix without checking those
+      after one that matched */
+  size_t match_suffixes(
+      candidate_span candidates,
+      std::vector<bool> *matches
+  ) const;
 
 public:
-  tree_stack_base(node_arena &arena) : arena(arena) {}
+  tree_stack_base(node_arena_base &arena)
+      : arena_tracked(&arena), arena(arena) {}
+  /** `has_suffix` for a `static_indexed_string`, with the loops over
+      its trees unrolled */
+  template <typename Static>
+  bool has_static_suffix(const Static &itree) const {
+    SUFFSTACK_COUNT(counters.has_suffix.calls, 1);
+    if (_size < Static::length) {
+      return false;
+    }
+    if constexpr (!Static::length) {
+      return true;
+    }
+    size_t on_right = Static::association_of(_size);
+    return has_split_suffix_within<Static::width>(
+        Static::length, on_right, itree.association(on_right)
+    );
+  }
+  /** `append` for a `static_indexed_string`, with the loops over its
+      trees unrolled */
+  template <typename Static> void append_static(const Static &itree) {
+    SUFFSTACK_COUNT(counters.append.calls, 1);
+    if constexpr (!Static::length) {
+      return;
+    }
+    size_t on_right = Static::association_of(_size + Static::length);
+    append_split_within<Static::width>(
+        Static::length, on_right, itree.association(on_right)
+    );
+    push_window(Static::length, itree.association(Static::length).right);
+  }
+  /** `apply` for `static_indexed_string`s, with the loops over their
+      trees unrolled */
+  template <typename Params, typename Results>
+  bool apply_static(const Params &params, const Results &results) {
+    SUFFSTACK_COUNT(counters.apply.calls, 1);
+    constexpr size_t width = Params::width;
+    if (_size < Params::length) {
+      return false;
+    }
+    size_t on_right = Params::association_of(_size);
+    size_t on_left = Params::length - on_right;
+    indexed_string::split split = params.association(on_right);
+
+    for (size_t bit = 0; bit < width; ++bit) {
+      if ((on_right & the_bit(bit)) && trees[bit] != split.right[bit]) {
+        return false;
+      }
+    }
+
+    // as in `apply`, check the left tree while splitting off the rest
+    tree_slots kept;
+    size_t kept_bits = 0, split_bit = 0;
+    if (on_left) {
+      split_bit = std::countr_zero(_size - on_right);
+      const node_or_leaf *splitting = trees[split_bit];
+      size_t bit_no = split_bit;
+      // O(log(size())), none of the string's leaves are this high
+      for (; bit_no > width; --bit_no) {
+        const node *branch = static_cast<const node *>(splitting);
+        SUFFSTACK_COUNT(counters.apply.descents, 1);
+        kept[bit_no - 1] = branch->lhs;
+        splitting = branch->rhs;
+      }
+      kept_bits = (the_bit(split_bit) - 1) & ~(the_bit(bit_no) - 1);
+      size_t suffix = on_left;
+      for (size_t bit = width; bit--;) {
+        if (bit >= bit_no || !suffix) continue;
+        const node *branch = static_cast<const node *>(splitting);
+        SUFFSTACK_COUNT(counters.apply.descents, 1);
+        if (suffix & the_bit(bit)) {
+          if (branch->rhs != split.left[bit]) {
+            return false;
+          }
+          suffix -= the_bit(bit);
+          splitting = branch->lhs;
+          if (!suffix) {
+            kept[bit] = branch->lhs;
+            kept_bits |= the_bit(bit);
+          }
+        } else {
+          kept[bit] = branch->lhs;
+          kept_bits |= the_bit(bit);
+          splitting = branch->rhs;
+        }
+      }
+    }
+
+    for (size_t bit = 0; bit < width; ++bit) {
+      if (on_right & the_bit(bit)) trees[bit] = nullptr;
+    }
+    if (on_left) {
+      trees[split_bit] = nullptr;
+      for (size_t bits = kept_bits; bits; bits &= bits - 1) {
+        size_t bit_no = std::countr_zero(bits);
+        trees[bit_no] = kept[bit_no];
+      }
+    }
+    pop_window(Params::length);
+    _size -= Params::length;
+
+    append_static(results);
+    return true;
+  }
 
   bool has_suffix(const indexed_string &itree) const;
+  bool has_suffix(const lazy_indexed_string &itree) const;
+  /** whether this stack ends with leaves related by `relation` to
+      those of `itree`, as a suffix whose types are subtypes of those
+      expected; O(log(size()) + log(itree.size())) comparisons of
+      trees, each memoized in the arena */
+  bool has_suffix_subsumed(
+      const indexed_string &itree,
+      const leaf_relation &relation
+  ) const;
+  /** whether any of `candidates` is a suffix of this stack, sharing
+      the descent of the stack's trees between candidates */
+  bool has_suffix_any(candidate_span candidates) const {
+    return first_matching_suffix(candidates) != candidates.size();
+  }
+  /** the index of the first of `candidates` which is a suffix of this
+      stack, or `candidates.size()` if none are */
+  size_t first_matching_suffix(candidate_span candidates) const {
+    return match_suffixes(candidates, nullptr);
+  }
+  /** for each of `candidates`, whether it is a suffix of this stack */
+  std::vector<bool> matching_suffixes(candidate_span candidates) const {
+    std::vector<bool> matches(candidates.size());
+    match_suffixes(candidates, &matches);
+    return matches;
+  }
   void append(const indexed_string &itree);
+  void append(const lazy_indexed_string &itree);
+  /** append a single leaf, which needs no indexed string; O(1)
+      amortized interns */
+  void push_leaf(const node_or_leaf *leaf);
+  /** if `params` is a suffix of this stack, replace it with `results`
+      and return true, otherwise leave the stack as it is; the same as
+      checking, popping and appending but descending the split tree
+      once. O(log(size()) + log(results.size())) */
+  bool apply(const indexed_string &params, const indexed_string &results);
   void truncate(size_t size);
   void pop(size_t count) { truncate(count > _size ? 0 : _size - count); }
+  /** call `visitor` with the leaves of the stack in order, bottom
+      first, a block at a time; O(size()) */
+  void for_each_leaf_block(const std::function<void(leaf_span)> &visitor
+  ) const;
+  /** call `visitor` with the leaves at [from, to) in order, counting
+      from the bottom; O(to - from + log(size())) */
+  void for_each_leaf_block(
+      size_t from,
+      size_t to,
+      const std::function<void(leaf_span)> &visitor
+  ) const;
+  /** the leaf at `index`, counting from the bottom; O(log(size())) */
+  const node_or_leaf *const &at(size_t index) const;
+  /** the number of leaves at the top of both stacks which are the same,
+      for stacks in the same arena; equal subtrees are skipped whole
+      where the stacks' sizes align them, which is O(log(size())) for
+      stacks of the same size, and O(n + log(size())) for a suffix of
+      `n` otherwise */
+  size_t longest_common_suffix(const tree_stack_base &o) const;
+  /** the top leaf of the stack, the reference is valid until the
+      stack is next changed; O(1) unless many leaves were popped since
+      it was last called. This and `peek` may refill the window of top
+      leaves, so they must not be called on a stack shared between
+      threads, which should share a `snapshot` instead */
   const node_or_leaf *const &back() const;
+  /** the top `k` leaves, the top last, for `k` up to
+      `window_capacity` and `size()`; valid until the stack is next
+      changed, O(k) unless many leaves were popped since it was last
+      called */
+  leaf_span peek(size_t k) const;
+  /** what this stack has done since it was made or copied, O(1) */
+  stack_stats stats() const {
+#if SUFFSTACK_STATS
+    return counters;
+#else
+    return {};
+#endif
+  }
+  /** the contents of this stack, which can be restored later; O(1) */
+  stack_snapshot snapshot() const { return {arena, trees, _size}; }
+  /** set the contents of this stack to those of `saved`, which must
+      be a snapshot of a stack in the same arena; O(1) */
+  void restore(const stack_snapshot &saved) {
+    trees = saved.trees;
+    _size = saved.size();
+    window_size = 0;
+  }
+  /** whether the stacks have the same contents, for stacks in the same
+      arena; O(log(size())) */
+  bool operator==(const tree_stack_base &o) const;
+  /** a hash of the contents of this stack, equal for stacks which are
+      equal; O(log(size())) */
+  size_t hash() const;
+  /** replace the trees of this stack with their promotions, to be
+      called before the arena's nodes are cleared; O(log(size())) plus
+      the promoted nodes */
+  void remap(node_promotion &promote);
+  void visit_trees(const tree_visitor &visitor) const;
 
   size_t size() const { return _size; }
   bool empty() const { return size() == 0; }
@@ -328,48 +2108,343 @@ public:
   reverse_iterator rend() const { return r_iterator(this, true); }
 };
 
-/** an explicitly typed suffix_stack implementation */
+/** a relation between leaves of a specific type, see `leaf_relation` */
 template <typename T>
-  requires can_hide_in_pointer<T>
-struct tree_stack : suffix_stack<indexed_string_over<T>, T>, tree_stack_base {
-  tree_stack(node_arena &arena) : tree_stack_base(arena) {}
+  requires leaf_value<T>
+struct leaf_relation_over : leaf_relation {
+  leaf_relation_over(std::function<bool(const T &ours, const T &theirs)> f)
+      : leaf_relation([f = std::move(f)](
+                          const node_or_leaf *ours, const node_or_leaf *theirs
+                      ) { return f(from_leaf<T>(ours), from_leaf<T>(theirs)); }
+        ) {}
+};
+
+/** an interned stack state, equal states are the same pointer so
+    that they are compared and hashed in constant time, for keying
+    memoized results on stack contents */
+struct stack_state {
+  const stack_snapshot *state = nullptr;
+
+  explicit operator bool() const { return state; }
+  size_t size() const { return state->size(); }
+  /** the contents of the state, to restore stacks to */
+  const stack_snapshot &snapshot() const { return *state; }
+  bool operator==(const stack_state &) const = default;
+};
+
+/** interns the states of stacks in an arena; states hold the nodes of
+    the arena, so they must be cleared when the arena is */
+struct stack_state_table {
+  stack_state_table() = default;
+  stack_state_table(const stack_state_table &) = delete;
+  stack_state_table &operator=(const stack_state_table &) = delete;
+
+  /** the state of `stack`, interning it if new; O(log(stack.size())) */
+  stack_state intern(const tree_stack_base &stack) {
+    return intern(stack.snapshot());
+  }
+  stack_state intern(const stack_snapshot &snapshot) {
+    return {&*states.insert(snapshot).first};
+  }
+  /** the state of `stack` if interned, or a null state */
+  stack_state find(const tree_stack_base &stack) const {
+    auto found = states.find(stack.snapshot());
+    return {found == states.end() ? nullptr : &*found};
+  }
+
+  size_t size() const { return states.size(); }
+  /** forget all states, invalidating them */
+  void clear() { states.clear(); }
+
+private:
+  struct snapshot_hash {
+    size_t operator()(const stack_snapshot &s) const { return s.hash(); }
+  };
+  // nodes of the set keep their address
+  std::unordered_set<stack_snapshot, snapshot_hash> states;
+};
+
+/** an explicitly typed `suffix_stack_like` implementation */
+template <typename T>
+  requires leaf_value<T>
+struct tree_stack
+    : static_suffix_stack<tree_stack<T>, indexed_string_over<T>, T>,
+      tree_stack_base {
+  tree_stack(node_arena_base &arena) : tree_stack_base(arena) {}
 
   // O(log(size()) + log(str.size()))
-  bool has_suffix(const indexed_string_over<T> &str) const override {
+  bool has_suffix(const indexed_string_over<T> &str) const {
     return tree_stack_base::has_suffix(str);
   }
   // O(log(size()) + log(str.size()))
-  void append(const indexed_string_over<T> &str) override {
+  void append(const indexed_string_over<T> &str) {
+    return tree_stack_base::append(str);
+  }
+  // O(log(size())), O(1) in the string's length
+  template <T... values>
+  bool has_suffix(const static_indexed_string<T, values...> &str) const {
+    return has_static_suffix(str);
+  }
+  // O(log(size()/str.size())) interns, O(1) in the string's length
+  template <T... values>
+  void append(const static_indexed_string<T, values...> &str) {
+    append_static(str);
+  }
+  using tree_stack_base::apply;
+  // O(log(size())), O(1) in the strings' lengths
+  template <T... params, T... results>
+  bool apply(
+      const static_indexed_string<T, params...> &from,
+      const static_indexed_string<T, results...> &to
+  ) {
+    return apply_static(from, to);
+  }
+  // O(log(size()) + log(str.size())), plus building the split once
+  bool has_suffix(const lazy_indexed_string_over<T> &str) const {
+    return tree_stack_base::has_suffix(str);
+  }
+  // O(log(size()) + log(str.size())), plus building the split once
+  void append(const lazy_indexed_string_over<T> &str) {
     return tree_stack_base::append(str);
   }
+  // O(1) amortized
+  void push(const T &value) { push_leaf(to_leaf(arena, value)); }
+  // O(log(size()))
+  void truncate(size_t size) { tree_stack_base::truncate(size); }
   // O(log(size()))
-  void truncate(size_t size) override { tree_stack_base::truncate(size); }
+  void pop(size_t count) { tree_stack_base::pop(count); }
   // O(log(size()))
-  void pop(size_t count) override { tree_stack_base::pop(count); }
+  const T &back() const {
+    return from_leaf<T>(tree_stack_base::back());
+  }
   // O(log(size()))
-  const T &back() const override {
-    return find_in_pointer<T>(tree_stack_base::back());
+  const T &at(size_t index) const {
+    return from_leaf<T>(tree_stack_base::at(index));
+  }
+  // O(k)
+  auto peek(size_t k) const {
+    return tree_stack_base::peek(k) |
+           std::views::transform([](const node_or_leaf *const &leaf
+                                 ) -> const T & {
+             return from_leaf<T>(leaf);
+           });
   }
 
   // O(1)
-  size_t size() const override { return tree_stack_base::size(); }
-  bool empty() const override { return tree_stack_base::empty(); }
+  size_t size() const { return tree_stack_base::size(); }
+  bool empty() const { return tree_stack_base::empty(); }
 
   struct rv_iterator : r_iterator {
     rv_iterator(r_iterator &&r) : r_iterator(std::forward<r_iterator>(r)) {}
 
-    const T &operator*() { return find_in_pointer<T>(r_iterator::operator*()); }
+    const T &operator*() { return from_leaf<T>(r_iterator::operator*()); }
     const T *operator->() { return &**this; }
   };
 
   rv_iterator rbegin() const { return tree_stack_base::rbegin(); }
   rv_iterator rend() const { return tree_stack_base::rend(); }
 
-  operator std::vector<T>() {
-    std::vector<T> ret(rbegin(), rend());
-    std::reverse(ret.begin(), ret.end());
+  /** copy the values at [from, to) into `out`, counting from the
+      bottom; O(to - from + log(size())) */
+  void copy_range(size_t from, size_t to, T *out) const {
+    for_each_leaf_block(from, to, [&](leaf_span block) {
+      for (const node_or_leaf *const &leaf : block) {
+        *out++ = from_leaf<T>(leaf);
+      }
+    });
+  }
+
+  operator std::vector<T>() const {
+    std::vector<T> ret;
+    ret.reserve(size());
+    for_each_leaf_block([&](leaf_span block) {
+      for (const node_or_leaf *const &leaf : block) {
+        ret.push_back(from_leaf<T>(leaf));
+      }
+    });
     return ret;
   }
 };
 
+/** a string for `hybrid_stack`, its values kept as they are and only
+    indexed the first time a stack needs its trees. The index is kept
+    for the arena it was built in, and rebuilt when a stack in another
+    arena needs it. Indexing mutates the string, so it may not be
+    shared between threads */
+template <typename T>
+  requires leaf_value<T>
+struct hybrid_string {
+  hybrid_string(std::vector<T> values) : _values(std::move(values)) {}
+  hybrid_string(const T &value) : _values{value} {}
+  /** a string indexed up front in `arena`, for stacks in `arena` */
+  hybrid_string(node_arena_base &arena, std::vector<T> values)
+      : _values(std::move(values)) {
+    indexed(arena);
+  }
+
+  size_t size() const { return _values.size(); }
+  bool empty() const { return _values.empty(); }
+  const std::vector<T> &values() const { return _values; }
+  /** whether a stack has needed this string's trees yet */
+  bool indexed_yet() const { return index.has_value(); }
+  /** the string indexed in `arena`, O(N log N) the first time for
+      each arena in turn and O(1) after */
+  const indexed_string_over<T> &indexed(node_arena_base &arena) const {
+    if (!index || index_arena != &arena) {
+      index.emplace(arena, _values);
+      index_arena = &arena;
+    }
+    return *index;
+  }
+
+private:
+  std::vector<T> _values;
+  mutable std::optional<indexed_string_over<T>> index;
+  mutable const node_arena_base *index_arena = nullptr;
+};
+
+/** a `suffix_stack_like` which keeps its values in a vector while it is
+    short, as `naive_stack` does, which is fastest for short stacks,
+    and moves them to a `tree_stack` as it grows past `flat_limit`,
+    whose operations stay O(log(size())) however large it grows. It
+    moves them back once it is truncated to half of `flat_limit`, and
+    no sooner than `flat_limit` appends and truncations since it moved
+    them to the tree stack. A size near the limit therefore doesn't
+    switch back and forth, and operations that cross it over and over
+    pay for at most one O(flat_limit) move per `flat_limit` operations.
+
+    In tree form, strings of at most `short_string` are compared with
+    the top leaves of the tree stack and appended a leaf at a time, so
+    only longer strings are ever indexed. */
+template <typename T>
+  requires leaf_value<T>
+struct hybrid_stack
+    : static_suffix_stack<hybrid_stack<T>, hybrid_string<T>, T> {
+  using string = hybrid_string<T>;
+  static constexpr size_t short_string = tree_stack_base::window_capacity;
+
+  hybrid_stack(node_arena_base &arena, size_t flat_limit = 64)
+      : arena(arena), flat_limit(flat_limit), tree(arena) {}
+
+  // O(str.size()) while flat or for short strings,
+  // O(log(size()) + log(str.size())) otherwise, plus indexing it once
+  bool has_suffix(const string &str) const {
+    const std::vector<T> &values = str.values();
+    if (values.size() > size()) return false;
+    if (!in_tree) {
+      return std::equal(values.rbegin(), values.rend(), flat.rbegin());
+    }
+    if (values.size() <= short_string) {
+      return std::ranges::equal(tree.peek(values.size()), values);
+    }
+    return tree.has_suffix(str.indexed(arena));
+  }
+  // as `has_suffix`, and O(size()) when moving to the tree stack
+  void append(const string &str) {
+    const std::vector<T> &values = str.values();
+    if (!in_tree) {
+      if (flat.size() + values.size() <= flat_limit) {
+        flat.insert(flat.end(), values.begin(), values.end());
+        return;
+      }
+      to_tree();
+    }
+    ++tree_ops;
+    if (values.size() <= short_string) {
+      for (const T &value : values) tree.push(value);
+    } else {
+      tree.append(str.indexed(arena));
+    }
+  }
+  // O(1) while flat, O(log(size())) plus O(1) amortized for moving
+  // back to the vector
+  void truncate(size_t size) {
+    if (!in_tree) {
+      flat.erase(flat.begin() + size, flat.end());
+      return;
+    }
+    tree.truncate(size);
+    if (++tree_ops >= flat_limit && size <= flat_limit / 2) to_flat();
+  }
+  // O(1) amortized
+  const T &back() const { return in_tree ? tree.back() : flat.back(); }
+  // O(1) while flat, O(log(size())) otherwise
+  const T &at(size_t index) const {
+    return in_tree ? tree.at(index) : flat[index];
+  }
+
+  size_t size() const { return in_tree ? tree.size() : flat.size(); }
+  /** whether the values are held by the tree stack */
+  bool is_tree() const { return in_tree; }
+
+  struct r_iterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    const hybrid_stack *stack;
+    /** the number of values not yet visited */
+    size_t remaining;
+
+    const T &operator*() const { return stack->at(remaining - 1); }
+    const T *operator->() const { return &**this; }
+    r_iterator &operator++() {
+      --remaining;
+      return *this;
+    }
+    r_iterator operator++(int) {
+      r_iterator was = *this;
+      ++*this;
+      return was;
+    }
+    bool operator==(const r_iterator &o) const {
+      return remaining == o.remaining;
+    }
+  };
+  // O(log(size())) for each value in tree form
+  r_iterator rbegin() const { return {this, size()}; }
+  r_iterator rend() const { return {this, 0}; }
+
+  operator std::vector<T>() const {
+    return in_tree ? std::vector<T>(tree) : flat;
+  }
+
+private:
+  node_arena_base &arena;
+  size_t flat_limit;
+  bool in_tree = false;
+  // appends and truncations since moving to the tree stack
+  size_t tree_ops = 0;
+  // kept, with its capacity, while in tree form
+  std::vector<T> flat;
+  tree_stack<T> tree;
+
+  void to_tree() {
+    for (const T &value : flat) tree.push(value);
+    flat.clear();
+    in_tree = true;
+    tree_ops = 0;
+  }
+  void to_flat() {
+    tree.for_each_leaf_block([&](tree_stack_base::leaf_span block) {
+      for (const node_or_leaf *const &leaf : block) {
+        flat.push_back(from_leaf<T>(leaf));
+      }
+    });
+    tree.truncate(0);
+    in_tree = false;
+  }
+};
+
 } // namespace suffstack
+
+namespace std {
+/** hash implementation for stack states, for memoizing on them */
+template <> struct hash<suffstack::stack_state> {
+  size_t operator()(suffstack::stack_state s) const {
+    return (size_t)suffstack::mix_bits((uintptr_t)s.state);
+  }
+};
+} // namespace std
@@ -1,10 +1,23 @@
 #include "suffstack.hpp"
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <tuple>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -34,6 +47,17 @@ struct config {
   unsigned long random_count = integer("RANDOM_COUNT", 1 << 10);
   /** seed for the random number generator */
   unsigned long seed = integer("RANDOM_SEED", 0);
+  /** number of distinct strings in the fixed pool benchmark */
+  unsigned long pool_size = integer("POOL_SIZE", 64);
+  /** capacity of the indexed string cache in the fixed pool benchmark */
+  unsigned long cache_size = integer("CACHE_SIZE", 48);
+  /** number of functions checked by the garbage collection benchmark */
+  unsigned long gc_functions = integer("GC_FUNCTIONS", 1 << 10);
+  /** maximum number of threads for the threaded benchmark */
+  unsigned long threads =
+      integer("THREADS", std::max(1u, std::thread::hardware_concurrency()));
+  /** length of the longest string indexed by the parallel benchmark */
+  unsigned long index_length = integer("INDEX_LENGTH", 1 << 16);
 
   unsigned long integer(const char *env, unsigned long dflt) {
     char *value = std::getenv(env);
@@ -48,6 +72,24 @@ struct config {
 
 static config cfg;
 
+/** counts every allocation made through `operator new` */
+static std::atomic<size_t> allocations{0};
+
+// not inlined, so GCC doesn't pair `malloc` with `operator delete`
+#if defined __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+NOINLINE void *operator new(size_t size) {
+  ++allocations;
+  if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+NOINLINE void operator delete(void *ptr) noexcept { std::free(ptr); }
+NOINLINE void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
 static void escape(void *p) {
 #if defined __GNUC__
   asm volatile("" : : "g"(p) : "memory");
@@ -107,6 +149,14 @@ struct cumulative_timer {
   }
 };
 
+std::ostream &operator<<(std::ostream &os, const probe_stats &stats) {
+  return os << "\nEntries\t" << stats.entries << "\nCapacity\t"
+            << stats.capacity << "\nMean probe\t" << stats.mean_probe()
+            << "\nMax probe\t" << stats.max_probe << "\nDisplaced rate\t"
+            << stats.collision_rate() << "\nFull hash collisions\t"
+            << stats.hash_collisions;
+}
+
 template <typename V>
 void print_vector(std::ostream &os, const std::vector<V> &v) {
   if (v.empty()) {
@@ -134,8 +184,9 @@ template <typename Stack, typename... PrefixArgs> struct tester {
 
   void run() { call_helper(&tester::run_with); }
 
-  void randomised(unsigned long seed, unsigned long op_count) {
-    call_helper(&tester::randomised_with, seed, op_count);
+  void
+  randomised(const char *name, unsigned long seed, unsigned long op_count) {
+    call_helper(&tester::randomised_with, name, seed, op_count);
   }
 
   template <typename F, typename... Args>
@@ -232,6 +283,7 @@ template <typename Stack, typename... PrefixArgs> struct tester {
   }
 
   void randomised_with(
+      const char *name,
       unsigned long seed,
       unsigned long op_count,
       PrefixArgs &...args
@@ -243,16 +295,64 @@ template <typename Stack, typename... PrefixArgs> struct tester {
 
     cumulative_timer baseline_clk, impl_clk;
     constexpr const char *tag_trunc = "truncate", *tag_check = "has_suffix",
-                         *tag_append = "append", *tag_index = "index";
+                         *tag_append = "append", *tag_index = "index",
+                         *tag_apply = "apply", *tag_back = "back";
 
     double total_height = 0;
 
     naive_stack<int> baseline;
     stack stk(args...);
     for (unsigned idx = 0; idx < op_count; ++idx) {
-      unsigned op = rand_int(3);
+      unsigned op = rand_int(4);
 
       switch (op) {
+      case 3: {
+        if (baseline.size() != 0) {
+          // check, pop and push as an instruction does
+          size_t count = rand_int(baseline.size()) / cfg.pop_ratio;
+          size_t result_count = rand_int(cfg.max_push) / cfg.pop_ratio;
+          if (cfg.print_ops) {
+            std::cout << "Applying p=" << count << ", r=" << result_count
+                      << "\n";
+          }
+          std::vector<int> params(
+              baseline.values.end() - count, baseline.values.end()
+          );
+          std::vector<int> results;
+          results.reserve(result_count);
+          for (size_t i = 0; i < result_count; ++i) {
+            results.push_back((int)rand_int(128));
+          }
+          string indexed_params = impl_clk.time(tag_index, [&]() {
+            return string(args..., params);
+          });
+          string indexed_results = impl_clk.time(tag_index, [&]() {
+            return string(args..., results);
+          });
+          baseline_clk.time(tag_apply, [&]() {
+            assert(baseline.has_suffix(params));
+            baseline.pop(count);
+            baseline.append(results);
+          });
+          constexpr bool fused = requires(string s) { stk.apply(s, s); };
+          bool correct = impl_clk.time(tag_apply, [&]() {
+            if constexpr (fused) {
+              return stk.apply(indexed_params, indexed_results);
+            } else {
+              if (!stk.has_suffix(indexed_params)) return false;
+              stk.pop(count);
+              stk.append(indexed_results);
+              return true;
+            }
+          });
+          if (!correct) {
+            std::cout << "Failed, incorrect suffix\n";
+            std::exit(1);
+          }
+          break;
+        }
+      }
+        // fall through
       case 0: {
         if (baseline.size() != 0) {
           size_t count = rand_int(baseline.size()) / cfg.pop_ratio;
@@ -327,6 +427,14 @@ template <typename Stack, typename... PrefixArgs> struct tester {
         std::cout << "Checking length n=" << baseline.size() << "\n";
       }
       assert(baseline.size() == stk.size());
+      if (baseline.size() != 0) {
+        // peeking at the top, as most instructions do
+        int base_back = baseline_clk.time(tag_back, [&]() {
+          return baseline.back();
+        });
+        int back = impl_clk.time(tag_back, [&]() { return stk.back(); });
+        assert(back == base_back);
+      }
       if (cfg.print_vecs) {
         std::cout << " Expected: ";
         print_vector(std::cout, baseline.values);
@@ -342,16 +450,1548 @@ template <typename Stack, typename... PrefixArgs> struct tester {
     std::cout << "=========\t=========\t======\n";
     std::cout << "Baseline:\n---" << baseline_clk << "\n";
     std::cout << "=========\t=========\t======\n";
-    std::cout << "Benchmarked:\n---" << impl_clk << "\n\n";
+    std::cout << "Benchmarked (" << name << "):\n---" << impl_clk << "\n\n";
+  }
+};
+
+/** stacks in two child arenas of a shared parent, which itself has a
+    parent, promoted into the shared parent one after the other */
+void promotion_test() {
+  std::vector<int> common, values;
+  for (int i = 0; i < 32; ++i) common.push_back(i);
+  for (int i = 0; i < 100; ++i) values.push_back(i * 7 % 13);
+
+  node_arena root;
+  indexed_string_over<int> common_str(root, common);
+  size_t in_root = root.size();
+  node_arena shared(&root);
+  node_arena left(&shared), right(&shared);
+
+  tree_stack<int> left_stk(left), right_stk(right);
+  indexed_string_over<int> left_str(left, values), right_str(right, values);
+  left_stk.append(common_str);
+  left_stk.append(left_str);
+  right_stk.append(common_str);
+  right_stk.append(right_str);
+  assert(left.size() != 0 && left.size() == right.size());
+  assert(!right_stk.has_suffix(left_str));
+
+  node_promotion left_promotion(left);
+  left_stk.remap(left_promotion);
+  left_str.remap(left_promotion);
+  left.clear();
+  size_t promoted = shared.size();
+  assert(promoted != 0 && promoted == left_promotion.size());
+
+  node_promotion right_promotion(right);
+  right_stk.remap(right_promotion);
+  right_str.remap(right_promotion);
+  right.clear();
+  // all of right's nodes were promoted from left already
+  assert(shared.size() == promoted);
+  assert(root.size() == in_root);
+
+  assert(right_stk.has_suffix(left_str) && left_stk.has_suffix(right_str));
+  std::vector<int> left_values = left_stk, right_values = right_stk;
+  assert(left_values == right_values);
+
+  // interning in a child now finds the promoted nodes
+  indexed_string_over<int> again(left, values);
+  assert(left.size() == 0);
+  assert(left_stk.has_suffix(again));
+}
+
+/** garbage from checking a function is reclaimed by rolling back */
+void rollback_test() {
+  std::mt19937 rng(cfg.seed);
+  std::vector<int> values;
+  for (int i = 0; i < 100; ++i) values.push_back(i % 9);
+
+  node_arena arena;
+  tree_stack<int> stk(arena);
+  indexed_string_over<int> kept(arena, values);
+  stk.append(kept);
+  size_t before = arena.size();
+  node_arena::mark checkpoint = arena.checkpoint();
+
+  {
+    tree_stack<int> function_stk(arena);
+    indexed_string_over<int> temp(arena, std::vector<int>(100, 100));
+    function_stk.append(temp);
+    function_stk.append(kept);
+    assert(function_stk.has_suffix(kept));
+  }
+  arena.rollback(checkpoint);
+  assert(arena.size() == before);
+
+  // stacks may grow past the mark, as long as they shrink back
+  stk.append(indexed_string_over<int>(arena, std::vector<int>(77, 101)));
+  stk.truncate(values.size());
+  arena.rollback(checkpoint);
+  assert(stk.has_suffix(kept));
+
+  for (int round = 0; round < 32; ++round) {
+    std::vector<int> garbage(200);
+    for (int &v : garbage) v = (int)(rng() % 16);
+    indexed_string_over<int>(arena, garbage);
+    arena.rollback(checkpoint);
+    assert(arena.size() == before);
+  }
+
+  // the surviving nodes are still found
+  indexed_string_over<int> again(arena, values);
+  assert(arena.size() == before);
+  assert(stk.has_suffix(again));
+}
+
+/** unreachable nodes are freed and reused by collection */
+void collect_test() {
+  std::vector<int> values, other;
+  for (int i = 0; i < 100; ++i) values.push_back(i % 9);
+  for (int i = 0; i < 100; ++i) other.push_back(i % 11);
+
+  node_arena arena;
+  indexed_string_over<int> str(arena, values);
+  tree_stack<int> stk(arena);
+  stk.append(str);
+  size_t reachable = arena.size();
+  {
+    tree_stack<int> garbage(arena);
+    garbage.append(indexed_string_over<int>(arena, other));
+    garbage.append(str);
+  }
+  size_t freed = arena.collect_from(stk, str);
+  size_t reserved = arena.reserved_bytes();
+  assert(freed != 0 && arena.size() == reachable);
+  assert(stk.has_suffix(str));
+  assert(arena.collect_from(stk, str) == 0);
+
+  // freed nodes are reused, and can be rolled back again
+  node_arena::mark checkpoint = arena.checkpoint();
+  indexed_string_over<int>(arena, other);
+  assert(arena.size() > reachable && arena.size() <= reachable + freed);
+  assert(arena.reserved_bytes() == reserved);
+  arena.rollback(checkpoint);
+  assert(arena.size() == reachable);
+
+  indexed_string_over<int> again(arena, values);
+  assert(arena.size() == reachable);
+  assert(stk.has_suffix(again));
+}
+
+/** a stream of functions, each checked with a stack living for a
+    random number of functions, with an arena that only grows and one
+    collected every 64 functions; memory is compared by the arenas'
+    reserved bytes, since the process's resident set also holds
+    whatever earlier runs left behind */
+void collect_benchmark() {
+  std::cout << "Arena\tTime\tOps\tNs/op\tNodes\tReserved";
+  for (bool collecting : {false, true}) {
+    std::mt19937 rng(cfg.seed);
+    node_arena arena;
+    std::deque<tree_stack<int>> live;
+    size_t ops = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long fn = 0; fn < cfg.gc_functions; ++fn) {
+      tree_stack<int> &stk = live.emplace_back(arena);
+      for (int op = 0; op < 16; ++op, ++ops) {
+        if (rng() % 3 == 0) {
+          stk.pop(rng() % (stk.size() + 1));
+          continue;
+        }
+        std::vector<int> to_push(rng() % 64);
+        for (int &v : to_push) v = (int)(rng() % 128);
+        stk.append(indexed_string_over<int>(arena, to_push));
+      }
+      while (live.size() > 1 + rng() % 64) live.pop_front();
+      if (collecting && fn % 64 == 63) {
+        arena.collect([&](const tree_visitor &visitor) {
+          for (const tree_stack<int> &s : live) s.visit_trees(visitor);
+        });
+      }
+    }
+    auto time = std::chrono::steady_clock::now() - start;
+
+    std::cout << "\n"
+              << (collecting ? "collected" : "never freed") << "\t" << time
+              << "\t" << ops << "\t" << time.count() / ops << "\t"
+              << arena.size() << "\t" << arena.reserved_bytes();
+  }
+  std::cout << "\n\n";
+}
+
+/** lazy strings build the same splits as eagerly indexed ones */
+void lazy_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (size_t length = 0; length < 70; ++length) {
+    std::vector<int> values(length);
+    for (int &v : values) v = (int)(rng() % 4);
+    indexed_string_over<int> eager(arena, values);
+    lazy_indexed_string_over<int> lazy(arena, values);
+    for (size_t on_right = 0; on_right <= length; ++on_right) {
+      indexed_string::split expected = eager.association(on_right),
+                            actual = lazy.association(on_right);
+      assert(std::ranges::equal(expected.left, actual.left));
+      assert(std::ranges::equal(expected.right, actual.right));
+    }
+  }
+
+  tree_stack<int> stk(arena);
+  std::vector<int> values(300);
+  for (int &v : values) v = (int)(rng() % 4);
+  lazy_indexed_string_over<int> lazy(arena, values);
+  stk.append(lazy);
+  stk.append(lazy);
+  assert(stk.size() == 600 && stk.has_suffix(lazy));
+  stk.pop(1);
+  assert(!stk.has_suffix(lazy));
+  stk.append(indexed_string_over<int>(values.back()));
+  assert(stk.has_suffix(indexed_string_over<int>(arena, values)));
+}
+
+/** indexing strings which are only checked once, eagerly and lazily */
+void lazy_benchmark() {
+  std::cout << "Length\tindexed_string\tlazy_indexed_string";
+  std::mt19937 rng(cfg.seed);
+  for (size_t length = 16; length <= cfg.max_push; length *= 4) {
+    node_arena eager_arena, lazy_arena;
+    tree_stack<int> eager_stk(eager_arena), lazy_stk(lazy_arena);
+    cumulative_timer clk;
+    for (int round = 0; round < 64; ++round) {
+      std::vector<int> values(length);
+      for (int &v : values) v = (int)(rng() % 128);
+      size_t pop = rng() % length;
+      clk.time("eager", [&]() {
+        indexed_string_over<int> str(eager_arena, values);
+        eager_stk.append(str);
+        eager_stk.pop(pop);
+      });
+      clk.time("lazy", [&]() {
+        lazy_indexed_string_over<int> str(lazy_arena, values);
+        lazy_stk.append(str);
+        lazy_stk.pop(pop);
+      });
+    }
+    std::cout << "\n"
+              << length << "\t" << clk.totals["eager"].duration << "\t"
+              << clk.totals["lazy"].duration;
+  }
+  std::cout << "\n\n";
+}
+
+/** the cache shares strings and evicts the least recently used */
+void cache_test() {
+  std::vector<int> a{1, 2, 3}, b{4, 5}, c{6, 7, 8, 9};
+  node_arena arena;
+  indexed_string_cache_over<int> cache(arena, 2);
+
+  auto a_str = cache.get(a);
+  auto b_str = cache.get(b);
+  assert(cache.get(a) == a_str);
+  // b is the least recently used
+  auto c_str = cache.get(c);
+  assert(cache.size() == 2);
+  assert(cache.get(b) != b_str);
+  assert(cache.get(c) == c_str);
+  assert(cache.hits() == 2 && cache.misses() == 4);
+
+  // evicted strings stay valid while held
+  tree_stack<int> stk(arena);
+  stk.append(*a_str);
+  stk.append(*b_str);
+  assert(stk.has_suffix(*cache.get(b)));
+  assert(stk.has_suffix(*b_str));
+  assert(!stk.has_suffix(*c_str));
+}
+
+/** checks of strings drawn from a fixed pool, as function types are,
+    indexed for each check or drawn from a cache */
+void cache_benchmark() {
+  std::mt19937 rng(cfg.seed);
+  std::vector<std::vector<int>> pool(cfg.pool_size);
+  for (std::vector<int> &values : pool) {
+    values.resize(rng() % (cfg.max_push / 8 + 1));
+    for (int &v : values) v = (int)(rng() % 128);
+  }
+  std::vector<size_t> draws(cfg.random_count * 4);
+  for (size_t &draw : draws) draw = rng() % pool.size();
+
+  std::cout << "Strings\tTime\tHit rate";
+  for (bool cached : {false, true}) {
+    node_arena arena;
+    indexed_string_cache_over<int> cache(arena, cfg.cache_size);
+    tree_stack<int> stk(arena);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t draw : draws) {
+      const std::vector<int> &values = pool[draw];
+      if (cached) {
+        auto str = cache.get(values);
+        stk.append(*str);
+        assert(stk.has_suffix(*str));
+      } else {
+        indexed_string_over<int> str(arena, values);
+        stk.append(str);
+        assert(stk.has_suffix(str));
+      }
+      stk.pop(values.size() / 2);
+    }
+    auto time = std::chrono::steady_clock::now() - start;
+    std::cout << "\n"
+              << (cached ? "indexed_string_cache" : "indexed_string_over")
+              << "\t" << time << "\t" << cache.hit_rate();
+  }
+  std::cout << "\n\n";
+}
+
+/** once warm, indexing with a workspace doesn't allocate */
+void workspace_test() {
+  std::mt19937 rng(cfg.seed);
+  std::vector<std::vector<int>> strings(32);
+  for (std::vector<int> &values : strings) {
+    values.resize(rng() % 40);
+    for (int &v : values) v = (int)(rng() % 8);
+  }
+
+  node_arena arena;
+  tree_stack<int> stk(arena);
+  index_workspace workspace;
+  indexed_string_over<int> str;
+  for (int pass = 0; pass < 2; ++pass) {
+    size_t before = allocations;
+    for (const std::vector<int> &values : strings) {
+      str.index_from(arena, values, workspace);
+      stk.append(str);
+      assert(stk.has_suffix(str));
+      stk.pop(values.size());
+    }
+    assert(pass == 0 || allocations == before);
+  }
+
+#if !SUFFSTACK_CHECK_ROLLBACK
+  // stacks keep their trees inline, so a stack for each call frame
+  // costs nothing to make
+  size_t before = allocations;
+  for (const std::vector<int> &values : strings) {
+    str.index_from(arena, values, workspace);
+    tree_stack<int> frame(arena);
+    frame.append(str);
+    assert(frame.has_suffix(str));
+  }
+  assert(allocations == before);
+#endif
+
+  for (const std::vector<int> &values : strings) {
+    str.index_from(arena, values, workspace);
+    indexed_string_over<int> fresh(arena, values);
+    for (size_t on_right = 0; on_right <= values.size(); ++on_right) {
+      assert(std::ranges::equal(
+          str.association(on_right).left, fresh.association(on_right).left
+      ));
+      assert(std::ranges::equal(
+          str.association(on_right).right, fresh.association(on_right).right
+      ));
+    }
+  }
+}
+
+/** a single arena behind a global mutex, for comparison with a
+    concurrent arena */
+struct locked_node_arena : node_arena_base {
+  node_arena arena;
+  mutable std::mutex mutex;
+
+  const node *
+  find_local(const node_or_leaf *lhs, const node_or_leaf *rhs) const override {
+    std::lock_guard lock(mutex);
+    return arena.find_local(lhs, rhs);
+  }
+  const node *
+  intern_local(const node_or_leaf *lhs, const node_or_leaf *rhs) override {
+    std::lock_guard lock(mutex);
+    return arena.intern_local(lhs, rhs);
+  }
+};
+
+/** run `op_count` random operations split over `threads` threads,
+    each with its own stack, all interning into `arena`; returns the
+    wall time */
+std::chrono::steady_clock::duration threaded_with(
+    node_arena_base &arena,
+    unsigned long threads,
+    unsigned long op_count
+) {
+  std::vector<int> shared_values;
+  for (int i = 0; i < 333; ++i) shared_values.push_back(i % 7);
+  std::vector<const node_or_leaf *> shared_roots(threads);
+
+  auto worker = [&](unsigned long thread) {
+    std::mt19937 rng(cfg.seed + thread);
+    auto rand_int = [&](unsigned i) {
+      return std::uniform_int_distribution<unsigned>(0, i)(rng);
+    };
+    naive_stack<int> baseline;
+    tree_stack<int> stk(arena);
+    for (unsigned long idx = thread; idx < op_count; idx += threads) {
+      switch (rand_int(2)) {
+      case 0: {
+        size_t count = rand_int(baseline.size()) / cfg.pop_ratio;
+        baseline.pop(count);
+        stk.pop(count);
+        break;
+      }
+      case 1: {
+        size_t count = rand_int(baseline.size());
+        std::vector<int> to_check(
+            baseline.values.end() - count, baseline.values.end()
+        );
+        assert(stk.has_suffix(indexed_string_over<int>(arena, to_check)));
+        break;
+      }
+      case 2: {
+        std::vector<int> to_push(rand_int(cfg.max_push));
+        for (int &v : to_push) v = (int)rand_int(128);
+        baseline.append(to_push);
+        stk.append(indexed_string_over<int>(arena, to_push));
+        break;
+      }
+      }
+      assert(baseline.size() == stk.size());
+    }
+    indexed_string_over<int> shared(arena, shared_values);
+    shared_roots[thread] = shared.association(shared.size()).right.back();
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (unsigned long t = 0; t < threads; ++t) pool.emplace_back(worker, t);
+  for (std::thread &t : pool) t.join();
+  auto time = std::chrono::steady_clock::now() - start;
+
+  for (const node_or_leaf *root : shared_roots) {
+    assert(root == shared_roots.front());
+  }
+  return time;
+}
+
+void threaded_scaling() {
+  std::cout << "Threads\tconcurrent_node_arena\tlocked_node_arena";
+  for (unsigned long threads = 1;; threads *= 2) {
+    threads = std::min(threads, cfg.threads);
+    concurrent_node_arena concurrent(
+        nullptr, concurrent_node_arena::bucket_bits_for(1 << 20)
+    );
+    locked_node_arena locked;
+    std::cout << "\n"
+              << threads << "\t"
+              << threaded_with(concurrent, threads, cfg.random_count) << "\t"
+              << threaded_with(locked, threads, cfg.random_count);
+    if (threads == cfg.threads) break;
+  }
+  std::cout << "\n\n";
+}
+
+/** random candidate strings, some of which are suffixes of `values`,
+    with lengths drawn from `lengths` if given */
+std::vector<indexed_string_over<int>> suffix_candidates(
+    node_arena_base &arena,
+    const std::vector<int> &values,
+    size_t count,
+    std::mt19937 &rng,
+    const std::vector<size_t> &lengths = {}
+) {
+  std::vector<indexed_string_over<int>> candidates;
+  for (size_t i = 0; i < count; ++i) {
+    size_t length = lengths.empty() ? rng() % (values.size() + 2)
+                                    : lengths[rng() % lengths.size()];
+    std::vector<int> suffix(
+        values.end() - std::min(length, values.size()), values.end()
+    );
+    if (length > values.size()) suffix.insert(suffix.begin(), 0);
+    if (!suffix.empty() && rng() % 2) suffix[rng() % suffix.size()] ^= 1;
+    candidates.emplace_back(arena, suffix);
+  }
+  return candidates;
+}
+
+/** checking candidates together agrees with checking each of them */
+void batch_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 64; ++round) {
+    std::vector<int> values(rng() % 200);
+    for (int &v : values) v = (int)(rng() % 2);
+    tree_stack<int> stk(arena);
+    stk.append(indexed_string_over<int>(arena, values));
+    auto candidates = suffix_candidates(arena, values, rng() % 16, rng);
+    std::vector<const indexed_string *> pointers;
+    for (const auto &candidate : candidates) pointers.push_back(&candidate);
+
+    std::vector<bool> matches = stk.matching_suffixes(pointers);
+    size_t first = candidates.size();
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      assert(matches[i] == stk.has_suffix(candidates[i]));
+      if (matches[i]) first = std::min(first, i);
+    }
+    assert(stk.first_matching_suffix(pointers) == first);
+    assert(stk.has_suffix_any(pointers) == (first != candidates.size()));
+  }
+}
+
+/** checking a stack against several candidates one by one or together,
+    as a branch table checks its labels */
+void batch_benchmark() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  std::vector<int> values(cfg.max_push);
+  for (int &v : values) v = (int)(rng() % 2);
+  tree_stack<int> stk(arena);
+  stk.append(indexed_string_over<int>(arena, values));
+
+  std::cout << "Candidates\thas_suffix\tmatching_suffixes";
+  for (size_t count = 2; count <= 64; count *= 4) {
+    // labels of a few arities
+    auto candidates = suffix_candidates(
+        arena, values, count, rng, {1, 3, values.size() / 2}
+    );
+    std::vector<const indexed_string *> pointers;
+    for (const auto &candidate : candidates) pointers.push_back(&candidate);
+    cumulative_timer clk;
+    for (size_t round = 0; round < cfg.random_count; ++round) {
+      clk.time("each", [&]() {
+        std::vector<bool> matches(candidates.size());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+          matches[i] = stk.has_suffix(candidates[i]);
+        }
+        escape(&matches);
+      });
+      clk.time("batch", [&]() {
+        std::vector<bool> matches = stk.matching_suffixes(pointers);
+        escape(&matches);
+      });
+    }
+    std::cout << "\n"
+              << count << "\t" << clk.totals["each"].duration << "\t"
+              << clk.totals["batch"].duration;
+  }
+  std::cout << "\n\n";
+}
+
+/** applying a signature agrees with checking, popping and appending,
+    and leaves the stack alone if the parameters don't match */
+void apply_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 256; ++round) {
+    std::vector<int> values(rng() % 200), results(rng() % 8);
+    for (int &v : values) v = (int)(rng() % 2);
+    for (int &v : results) v = (int)(rng() % 2);
+    size_t count = rng() % (values.size() + 1);
+    std::vector<int> params(values.end() - count, values.end());
+    bool mismatch = !params.empty() && rng() % 2;
+    if (mismatch) params[rng() % params.size()] ^= 1;
+
+    tree_stack<int> fused(arena), unfused(arena);
+    fused.append(indexed_string_over<int>(arena, values));
+    unfused.append(indexed_string_over<int>(arena, values));
+    indexed_string_over<int> params_str(arena, params);
+    indexed_string_over<int> results_str(arena, results);
+    assert(fused.apply(params_str, results_str) == !mismatch);
+    if (!mismatch) {
+      unfused.pop(count);
+      unfused.append(results_str);
+    }
+    assert(fused.size() == unfused.size());
+    assert(std::vector<int>(fused) == std::vector<int>(unfused));
+  }
+}
+
+/** a value too large to hide in a pointer, like a reference type with
+    its heap type and nullability */
+struct ref_type {
+  uint64_t heap_type;
+  uint32_t depth;
+  bool nullable;
+  bool operator==(const ref_type &) const = default;
+};
+namespace std {
+template <> struct hash<ref_type> {
+  size_t operator()(const ref_type &r) const {
+    return (size_t)mix_bits(r.heap_type ^ (uint64_t)r.depth << 1 ^ r.nullable);
+  }
+};
+} // namespace std
+static_assert(!can_hide_in_pointer<ref_type> && leaf_value<ref_type>);
+
+/** stacks of values interned as leaves behave as stacks of hidden
+    values do, and share leaves between related arenas */
+void leaf_table_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena root;
+  node_arena arena(&root);
+  auto random_values = [&](size_t length) {
+    std::vector<ref_type> values(length);
+    for (ref_type &v : values) {
+      v = {rng() % 4, (uint32_t)(rng() % 2), rng() % 2 == 0};
+    }
+    return values;
+  };
+  ref_type some{1, 0, true};
+  assert(to_leaf(arena, some) == to_leaf(root, some));
+  assert(to_leaf(arena, some) != to_leaf(arena, ref_type{1, 0, false}));
+  assert(from_leaf<ref_type>(to_leaf(arena, some)) == some);
+  // roots likely reusing the address of the last, whose table threads
+  // must not keep using
+  for (int i = 0; i < 4; ++i) {
+    node_arena fresh;
+    assert(from_leaf<ref_type>(to_leaf(fresh, some)) == some);
+  }
+  assert(to_leaf(arena, some) == to_leaf(root, some));
+
+  // threads interning the same values agree on their leaves
+  concurrent_node_arena shared(nullptr, 8);
+  std::vector<ref_type> many = random_values(1024);
+  std::vector<std::vector<const leaf_base *>> leaves(4);
+  std::vector<std::thread> threads;
+  for (std::vector<const leaf_base *> &mine : leaves) {
+    threads.emplace_back([&]() {
+      for (const ref_type &v : many) mine.push_back(to_leaf(shared, v));
+    });
+  }
+  for (std::thread &t : threads) t.join();
+  for (const std::vector<const leaf_base *> &theirs : leaves) {
+    assert(theirs == leaves[0]);
+  }
+  for (size_t i = 0; i < many.size(); ++i) {
+    assert(from_leaf<ref_type>(leaves[0][i]) == many[i]);
+  }
+
+  naive_stack<ref_type> baseline;
+  tree_stack<ref_type> stk(arena);
+  for (int round = 0; round < 256; ++round) {
+    std::vector<ref_type> values = random_values(rng() % 32);
+    switch (rng() % 3) {
+    case 0:
+      stk.pop(values.size());
+      baseline.pop(std::min(values.size(), baseline.size()));
+      break;
+    case 1: {
+      size_t count = std::min(values.size(), baseline.size());
+      std::vector<ref_type> suffix(
+          baseline.values.end() - count, baseline.values.end()
+      );
+      if (!suffix.empty() && rng() % 2) {
+        suffix[rng() % count].nullable ^= true;
+      }
+      indexed_string_over<ref_type> str(arena, suffix);
+      assert(stk.has_suffix(str) == baseline.has_suffix(suffix));
+      break;
+    }
+    default:
+      stk.append(indexed_string_over<ref_type>(arena, values));
+      baseline.append(values);
+    }
+    assert(std::vector<ref_type>(stk) == baseline.values);
+    assert(stk.empty() || stk.back() == baseline.back());
+  }
+}
+
+/** suffixes checked under subtyping, where a non-nullable reference
+    is a subtype of the nullable one, agree with checking each value;
+    checking again reuses the memoized comparisons */
+void subsumed_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  size_t comparisons = 0;
+  auto subtype = [&](const ref_type &ours, const ref_type &theirs) {
+    ++comparisons;
+    return ours.heap_type == theirs.heap_type &&
+           ours.depth == theirs.depth && (theirs.nullable || !ours.nullable);
+  };
+  leaf_relation_over<ref_type> relation(subtype);
+  for (int round = 0; round < 128; ++round) {
+    std::vector<ref_type> values(rng() % 300);
+    for (ref_type &v : values) v = {rng() % 2, 0, rng() % 2 == 0};
+    tree_stack<ref_type> stk(arena);
+    stk.append(indexed_string_over<ref_type>(arena, values));
+    size_t count = rng() % (values.size() + 1);
+    std::vector<ref_type> expected(values.end() - count, values.end());
+    for (ref_type &v : expected) {
+      // mostly widen, sometimes narrow
+      if (rng() % 4) v.nullable = true;
+      else if (rng() % 8 == 0) v.nullable = false;
+    }
+    bool subsumed = std::equal(
+        values.end() - count, values.end(), expected.begin(), subtype
+    );
+    indexed_string_over<ref_type> str(arena, expected);
+    comparisons = 0;
+    assert(stk.has_suffix_subsumed(str, relation) == subsumed);
+    size_t first_comparisons = comparisons;
+    comparisons = 0;
+    assert(stk.has_suffix_subsumed(str, relation) == subsumed);
+    assert(comparisons <= first_comparisons);
+    assert(comparisons <= 2 * (size_t)std::bit_width(values.size()));
+  }
+
+  // relations made one after another, likely at the same address, are
+  // memoized apart
+  std::vector<int> zeros(64, 0), ones(64, 1);
+  indexed_string_over<int> zeros_str(arena, zeros), ones_str(arena, ones);
+  tree_stack<int> stk(arena);
+  stk.append(zeros_str);
+  auto subsumed_under = [&](bool lenient) {
+    leaf_relation_over<int> relation([&](int ours, int theirs) {
+      return lenient || ours == theirs;
+    });
+    return stk.has_suffix_subsumed(ones_str, relation);
+  };
+  assert(subsumed_under(true));
+  assert(!subsumed_under(false));
+
+  // a child arena forgets its comparisons of its parent's nodes once
+  // the parent rolls them back and reuses their addresses
+  node_arena parent, child(&parent);
+  leaf_relation_over<int> at_most(std::less_equal<int>{});
+  node_arena::mark before = parent.checkpoint();
+  for (bool swapped : {false, true}) {
+    const std::vector<int> &ours = swapped ? ones : zeros;
+    const std::vector<int> &theirs = swapped ? zeros : ones;
+    {
+      indexed_string_over<int> ours_str(parent, ours);
+      indexed_string_over<int> theirs_str(parent, theirs);
+      tree_stack<int> child_stk(child);
+      child_stk.append(ours_str);
+      assert(child_stk.has_suffix_subsumed(theirs_str, at_most) == !swapped);
+    }
+    parent.rollback(before);
+  }
+}
+
+/** copying slices of a stack built from several strings */
+void copy_range_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 64; ++round) {
+    tree_stack<int> stk(arena);
+    std::vector<int> values;
+    for (int piece = rng() % 4; piece >= 0; --piece) {
+      std::vector<int> part(rng() % 100);
+      for (int &v : part) v = (int)(rng() % 1000);
+      stk.append(indexed_string_over<int>(arena, part));
+      values.insert(values.end(), part.begin(), part.end());
+    }
+    for (int slice = 0; slice < 16; ++slice) {
+      size_t from = rng() % (values.size() + 1);
+      size_t to = from + rng() % (values.size() - from + 1);
+      std::vector<int> out(to - from + 1, -1);
+      stk.copy_range(from, to, out.data());
+      assert(std::equal(
+          values.begin() + from, values.begin() + to, out.begin()
+      ));
+      assert(out.back() == -1);
+    }
+  }
+}
+
+/** indexing into stacks, and the common tops of stacks which share
+    some of their leaves */
+void common_suffix_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 256; ++round) {
+    auto random_values = [&](size_t length) {
+      std::vector<int> values(length);
+      for (int &v : values) v = (int)(rng() % 3);
+      return values;
+    };
+    std::vector<int> head = random_values(rng() % 64);
+    std::vector<int> other_head = random_values(
+        rng() % 2 ? head.size() : rng() % 64
+    );
+    std::vector<int> tail = random_values(rng() % 64);
+    tree_stack<int> ours(arena), theirs(arena);
+    ours.append(indexed_string_over<int>(arena, head));
+    ours.append(indexed_string_over<int>(arena, tail));
+    theirs.append(indexed_string_over<int>(arena, other_head));
+    theirs.append(indexed_string_over<int>(arena, tail));
+
+    std::vector<int> our_values(ours), their_values(theirs);
+    for (size_t i = 0; i < our_values.size(); ++i) {
+      assert(ours.at(i) == our_values[i]);
+    }
+    auto [mismatch, their_mismatch] = std::mismatch(
+        our_values.rbegin(),
+        our_values.rend(),
+        their_values.rbegin(),
+        their_values.rend()
+    );
+    size_t common = mismatch - our_values.rbegin();
+    assert(ours.longest_common_suffix(theirs) == common);
+    assert(theirs.longest_common_suffix(ours) == common);
+    assert(ours.longest_common_suffix(ours) == ours.size());
+  }
+}
+
+/** a stack saved at a block and restored at its end, and stacks
+    built differently compared by their trees */
+void snapshot_test() {
+  std::vector<int> values{1, 2, 3, 4, 5, 6, 7}, body{8, 9, 10};
+  node_arena arena;
+  indexed_string_over<int> values_str(arena, values), body_str(arena, body);
+  tree_stack<int> stk(arena);
+  stk.append(values_str);
+  stack_snapshot block = stk.snapshot();
+  assert(block.size() == values.size());
+
+  stk.pop(3);
+  stk.append(body_str);
+  stk.append(body_str);
+  assert(stk.snapshot() != block);
+  stk.restore(block);
+  assert(stk.size() == values.size() && stk.has_suffix(values_str));
+  assert(stk.snapshot() == block);
+
+  // the same contents pushed in different pieces share their trees
+  tree_stack<int> pieces(arena);
+  for (int value : values) pieces.append(indexed_string_over<int>(value));
+  assert(pieces == stk);
+  pieces.pop(1);
+  assert(pieces != stk);
+  pieces.append(indexed_string_over<int>(0));
+  assert(pieces != stk);
+  pieces.truncate(0);
+  stk.truncate(0);
+  assert(pieces == stk);
+}
+
+/** equal stacks hash alike and intern to the same state, which keys
+    memoized results */
+void state_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  stack_state_table states;
+  // results keyed on (pc, stack state)
+  using key = std::pair<size_t, stack_state>;
+  struct key_hash {
+    size_t operator()(const key &k) const {
+      return std::hash<stack_state>()(k.second) ^ k.first;
+    }
+  };
+  std::unordered_map<key, size_t, key_hash> memo;
+  std::vector<std::vector<int>> contents;
+  for (int round = 0; round < 64; ++round) {
+    std::vector<int> values(rng() % 20);
+    for (int &v : values) v = (int)(rng() % 2);
+    // build it in pieces, so equal contents are built differently
+    tree_stack<int> stk(arena);
+    for (size_t at = 0; at < values.size();) {
+      size_t piece = std::min(values.size() - at, (size_t)rng() % 5 + 1);
+      std::vector<int> part(values.begin() + at, values.begin() + at + piece);
+      stk.append(indexed_string_over<int>(arena, part));
+      at += piece;
+    }
+    assert(stk.hash() == stk.snapshot().hash());
+
+    size_t seen = std::ranges::find(contents, values) - contents.begin();
+    assert(states.find(stk) || seen == contents.size());
+    stack_state state = states.intern(stk);
+    assert(state && state.size() == values.size());
+    assert(states.find(stk) == state);
+    assert(states.size() == std::max(contents.size(), seen + 1));
+    auto [memoized, fresh] = memo.try_emplace({0, state}, round);
+    assert(fresh == (seen == contents.size()));
+    if (fresh) {
+      contents.push_back(values);
+    } else {
+      tree_stack<int> earlier(arena);
+      earlier.restore(state.snapshot());
+      assert(earlier == stk && earlier.hash() == stk.hash());
+      assert(std::vector<int>(earlier) == values);
+    }
+  }
+}
+
+/** the top leaves stay right as strings are pushed and popped */
+void peek_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  naive_stack<int> baseline;
+  tree_stack<int> stk(arena);
+  stack_snapshot saved = stk.snapshot();
+  std::vector<int> saved_values;
+  for (int round = 0; round < 1024; ++round) {
+    std::vector<int> values(rng() % 12);
+    for (int &v : values) v = (int)(rng() % 64);
+    switch (rng() % 5) {
+    case 0:
+      stk.pop(values.size());
+      baseline.pop(std::min(values.size(), baseline.size()));
+      break;
+    case 1:
+      stk.append(lazy_indexed_string_over<int>(arena, values));
+      baseline.append(values);
+      break;
+    case 2: {
+      size_t count = std::min(values.size(), baseline.size());
+      std::vector<int> params(
+          baseline.values.end() - count, baseline.values.end()
+      );
+      stk.apply(
+          indexed_string_over<int>(arena, params),
+          indexed_string_over<int>(arena, values)
+      );
+      baseline.pop(count);
+      baseline.append(values);
+      break;
+    }
+    case 3:
+      if (rng() % 2) {
+        saved = stk.snapshot();
+        saved_values = baseline.values;
+      } else {
+        stk.restore(saved);
+        baseline.values = saved_values;
+      }
+      break;
+    default:
+      stk.append(indexed_string_over<int>(arena, values));
+      baseline.append(values);
+    }
+
+    assert(stk.size() == baseline.size());
+    // the top is kept in place while the stack is unchanged
+    const int *top = stk.empty() ? nullptr : &stk.back();
+    size_t most = std::min(stk.size(), tree_stack_base::window_capacity);
+    for (size_t k = 0; k <= most; ++k) {
+      assert(std::ranges::equal(
+          stk.peek(k), std::span(baseline.values).last(k)
+      ));
+    }
+    assert(!top || *top == baseline.values.back());
+    assert(stk.empty() || stk.back() == baseline.values.back());
+  }
+
+  // refilling the window below the top leaf doesn't move it
+  tree_stack<int> pushed(arena);
+  for (int i = 0; i < 10; ++i) pushed.push(i);
+  pushed.pop(9);
+  pushed.push(42);
+  const int &top = pushed.back();
+  assert(top == 42);
+  assert(std::ranges::equal(pushed.peek(2), std::vector{0, 42}));
+  assert(top == 42 && &top == &pushed.back());
+}
+
+/** reading a whole stack by walking it from the top, in order a block
+    at a time, and reading a slice of it */
+void iterate_benchmark() {
+  std::cout << "Length\tr_iterator\tfor_each_leaf_block\tstd::vector"
+               "\tcopy_range of 16";
+  std::mt19937 rng(cfg.seed);
+  for (size_t length = 1 << 10; length <= cfg.index_length; length *= 4) {
+    std::vector<int> values(length);
+    for (int &v : values) v = (int)(rng() % 128);
+    node_arena arena;
+    tree_stack<int> stk(arena);
+    // a stack of a few uneven trees
+    stk.append(indexed_string_over<int>(arena, values));
+    stk.pop(length / 3);
+    cumulative_timer clk;
+    for (int round = 0; round < 16; ++round) {
+      clk.time("walk", [&]() {
+        int sum = 0;
+        for (auto it = stk.rbegin(); it != stk.rend(); ++it) sum += *it;
+        escape(&sum);
+      });
+      clk.time("blocks", [&]() {
+        int sum = 0;
+        stk.for_each_leaf_block([&](tree_stack_base::leaf_span block) {
+          for (const auto &leaf : block) sum += find_in_pointer<int>(leaf);
+        });
+        escape(&sum);
+      });
+      clk.time("vector", [&]() {
+        std::vector<int> read(stk);
+        assert(std::ranges::equal(
+            read, std::span(values).first(length - length / 3)
+        ));
+        escape(&read);
+      });
+      clk.time("slice", [&]() {
+        int slice[16];
+        stk.copy_range(length / 3, length / 3 + 16, slice);
+        escape(slice);
+      });
+    }
+    std::cout << "\n"
+              << length << "\t" << clk.totals["walk"].duration << "\t"
+              << clk.totals["blocks"].duration << "\t"
+              << clk.totals["vector"].duration << "\t"
+              << clk.totals["slice"].duration;
+  }
+  std::cout << "\n\n";
+}
+
+/** indexing across a pool builds the same trees as indexing serially */
+void parallel_index_test() {
+  std::mt19937 rng(cfg.seed);
+  thread_pool pool(3);
+  // small enough to split all but the shortest strings
+  parallel_indexing parallel{pool, 4};
+  concurrent_node_arena arena(
+      nullptr, concurrent_node_arena::bucket_bits_for(1 << 16)
+  );
+  tree_stack<int> stk(arena);
+  for (size_t length : {0, 1, 3, 4, 5, 17, 64, 100, 1000}) {
+    std::vector<int> values(length);
+    for (int &v : values) v = (int)(rng() % 4);
+    indexed_string_over<int> serial(arena, values);
+    indexed_string_over<int> split(arena, values, parallel);
+    assert(serial.size() == split.size());
+    for (size_t on_right = 0; on_right <= length; ++on_right) {
+      assert(std::ranges::equal(
+          serial.association(on_right).left, split.association(on_right).left
+      ));
+      assert(std::ranges::equal(
+          serial.association(on_right).right,
+          split.association(on_right).right
+      ));
+    }
+    stk.append(split);
+    assert(stk.has_suffix(serial));
+  }
+}
+
+/** indexing single long strings across growing numbers of threads */
+void parallel_index_benchmark() {
+  std::cout << "Length\tThreads\tTime";
+  std::mt19937 rng(cfg.seed);
+  for (size_t length = 1 << 12; length <= cfg.index_length; length *= 4) {
+    std::vector<int> values(length);
+    for (int &v : values) v = (int)(rng() % 128);
+    for (unsigned long threads = 1;; threads *= 2) {
+      threads = std::min(threads, cfg.threads);
+      thread_pool pool(threads - 1);
+      concurrent_node_arena arena(
+          nullptr, concurrent_node_arena::bucket_bits_for(1 << 20)
+      );
+      auto start = std::chrono::steady_clock::now();
+      indexed_string_over<int> str(arena, values, {pool});
+      escape(&str);
+      auto time = std::chrono::steady_clock::now() - start;
+      std::cout << "\n" << length << "\t" << threads << "\t" << time;
+      if (threads == cfg.threads) break;
+    }
+  }
+  std::cout << "\n\n";
+}
+
+/** strings indexed from a mapped image share their nodes with a child
+    arena which indexes the same values */
+void image_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  std::vector<std::vector<int>> values;
+  std::vector<indexed_string_over<int>> strings;
+  for (size_t length : {0, 1, 2, 7, 64, 300}) {
+    values.emplace_back(length);
+    for (int &value : values.back()) value = (int)(rng() % 4);
+    strings.emplace_back(arena, values.back());
+  }
+  std::vector<const indexed_string *> written;
+  for (const indexed_string &string : strings) written.push_back(&string);
+  uintptr_t preferred_base = uintptr_t(1) << 44;
+  std::vector<uint64_t> image =
+      mapped_node_arena::write_image(written, preferred_base);
+
+  // whether the strings of `mapped` are those written, using each of
+  // them on a stack either way
+  auto matches = [&](mapped_node_arena &mapped) {
+    bool same = mapped.string_count() == strings.size();
+    node_arena child(&mapped);
+    for (size_t i = 0; i < std::min(values.size(), mapped.string_count());
+         ++i) {
+      indexed_string_over<int> loaded(mapped.string(i));
+      indexed_string_over<int> fresh(child, values[i]);
+      tree_stack<int> stk(child);
+      stk.append(loaded);
+      same &= std::vector<int>(stk) == values[i];
+      same &= stk.has_suffix(fresh);
+      if (!stk.empty()) same &= stk.back() == values[i].back();
+      stk.pop(stk.size() / 2);
+      same &= stk.has_suffix(fresh) == (stk.size() == values[i].size());
+    }
+    return same && child.size() == 0;
+  };
+  auto check = [&](mapped_node_arena &mapped) { assert(matches(mapped)); };
+  std::unique_ptr<mapped_node_arena> copied = mapped_node_arena::load(image);
+  assert(copied && copied->relocated());
+  check(*copied);
+
+  // damaged images are refused rather than read out of bounds
+  auto refused = [&](auto &&damage) {
+    std::vector<uint64_t> damaged = image;
+    damage(damaged);
+    return !mapped_node_arena::load(damaged);
+  };
+  using header = mapped_node_arena::image_header;
+  const size_t header_words = sizeof(header) / sizeof(uint64_t);
+  header written_header;
+  std::memcpy(&written_header, image.data(), sizeof(header));
+  assert(refused([](std::vector<uint64_t> &damaged) { damaged.pop_back(); }));
+  assert(refused([](std::vector<uint64_t> &damaged) { damaged[0] ^= 1; }));
+  assert(refused([](std::vector<uint64_t> &damaged) { ++damaged[1]; }));
+  assert(refused([](std::vector<uint64_t> &damaged) {
+    damaged.resize(header_words - 1);
+  }));
+  assert(refused([&](std::vector<uint64_t> &damaged) {
+    // a child of the last node, the tallest, out of the image
+    size_t last = header_words + 2 * written_header.node_count - 1;
+    damaged[last] += 1 << 20;
+  }));
+  assert(refused([&](std::vector<uint64_t> &damaged) {
+    // a tree of the longest string, written last, to a leaf's parent
+    damaged.back() = preferred_base + header_words * sizeof(uint64_t);
+  }));
+  assert(refused([&](std::vector<uint64_t> &damaged) {
+    // the same tree missing
+    damaged.back() = 0;
+  }));
+  for (size_t word = 0; word < image.size(); word += 7) {
+    std::vector<uint64_t> damaged = image;
+    damaged[word] ^= rng();
+    // those loaded anyway, with a leaf's value changed, are still
+    // safe to use
+    auto loaded = mapped_node_arena::load(damaged);
+    if (loaded) matches(*loaded);
+  }
+
+#ifdef __linux__
+  char path[] = "/tmp/suffstack-image-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  size_t bytes = image.size() * sizeof(uint64_t);
+  assert(write(fd, image.data(), bytes) == (ssize_t)bytes);
+  void *at = mmap(
+      (void *)preferred_base,
+      bytes,
+      PROT_READ,
+      MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+      fd,
+      0
+  );
+  close(fd);
+  unlink(path);
+  if (at != MAP_FAILED) {
+    std::span<const uint64_t> at_image(
+        static_cast<const uint64_t *>(at), image.size()
+    );
+    std::unique_ptr<mapped_node_arena> mapped =
+        mapped_node_arena::load(at_image);
+    assert(mapped && mapped->relocated() == (at != (void *)preferred_base));
+    check(*mapped);
+    munmap(at, bytes);
+  }
+#endif
+}
+
+/** static strings are checked, appended and applied as runtime
+    strings of the same values are */
+void static_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  std::tuple signatures{
+      static_indexed_string<int>(arena),
+      static_indexed_string<int, 1>(arena),
+      static_indexed_string<int, 0, 1>(arena),
+      static_indexed_string<int, 1, 1, 0>(arena),
+      static_indexed_string<int, 0, 1, 1, 0, 1, 0, 0>(arena),
+      static_indexed_string<int, 1, 0, 1, 1, 0, 0, 1, 0, 1>(arena),
+  };
+  auto runtime = [&](const auto &str) {
+    return indexed_string_over<int>(
+        arena, {str.leaves.begin(), str.leaves.end()}
+    );
+  };
+  for (int round = 0; round < 64; ++round) {
+    std::vector<int> values(rng() % 100);
+    for (int &v : values) v = (int)(rng() % 2);
+    indexed_string_over<int> values_str(arena, values);
+    auto check = [&](const auto &params, const auto &results) {
+      tree_stack<int> stk(arena), expected(arena);
+      stk.append(values_str);
+      expected.append(values_str);
+      if (rng() % 2) {
+        stk.append(params);
+        expected.append(runtime(params));
+        assert(stk == expected);
+      }
+      assert(stk.has_suffix(params) == expected.has_suffix(runtime(params)));
+      bool applied = stk.apply(params, results);
+      assert(applied == expected.apply(runtime(params), runtime(results)));
+      assert(stk == expected);
+      assert(std::vector<int>(stk) == std::vector<int>(expected));
+      if (!stk.empty()) assert(stk.back() == expected.back());
+    };
+    std::apply(
+        [&](const auto &...all) {
+          auto check_all = [&](const auto &params) {
+            (check(params, all), ...);
+          };
+          (check_all(all), ...);
+        },
+        signatures
+    );
+  }
+}
+
+namespace suffstack {
+/** appends tiny strings by the generic path, which `append` skips */
+struct tiny_append_baseline {
+  static void append(tree_stack_base &stk, const indexed_string &itree) {
+    stk.append_of(itree);
   }
 };
+} // namespace suffstack
+
+/** the path for appending tiny strings agrees with the generic one */
+void tiny_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 64; ++round) {
+    std::vector<int> values(rng() % 3000);
+    for (int &v : values) v = (int)(rng() % 2);
+    tree_stack<int> tiny(arena), generic(arena);
+    tiny.append(indexed_string_over<int>(arena, values));
+    tiny_append_baseline::append(
+        generic, indexed_string_over<int>(arena, values)
+    );
+    for (int op = 0; op < 64; ++op) {
+      std::vector<int> leaves(rng() % (tree_stack_base::tiny_size + 1));
+      for (int &v : leaves) v = (int)(rng() % 2);
+      indexed_string_over<int> str(arena, leaves);
+      assert(tiny.has_suffix(str) == generic.has_suffix(str));
+      if (rng() % 2) {
+        tiny.append(str);
+        tiny_append_baseline::append(generic, str);
+        values.insert(values.end(), leaves.begin(), leaves.end());
+      } else if (leaves.size() <= values.size()) {
+        tiny.truncate(tiny.size() - leaves.size());
+        generic.truncate(generic.size() - leaves.size());
+        values.resize(values.size() - leaves.size());
+      }
+      assert(tiny == generic && std::vector<int>(tiny) == values);
+      if (!values.empty()) assert(tiny.back() == values.back());
+    }
+  }
+}
+
+/** hybrid stacks move between their vector and tree forms as they
+    grow and shrink, at most once every `flat_limit` operations, and
+    only index strings too long to push leaf by leaf, in the arena of
+    the stack they are used with */
+void hybrid_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  for (int round = 0; round < 64; ++round) {
+    hybrid_stack<int> stack(arena, 16);
+    std::vector<int> values;
+    bool tree = false;
+    size_t tree_ops = 0;
+    for (int op = 0; op < 64; ++op) {
+      std::vector<int> leaves(rng() % 24);
+      for (int &v : leaves) v = (int)(rng() % 2);
+      hybrid_string<int> str(leaves);
+      bool expected =
+          leaves.size() <= values.size() &&
+          std::equal(leaves.rbegin(), leaves.rend(), values.rbegin());
+      assert(stack.has_suffix(str) == expected);
+      if (rng() % 3) {
+        stack.append(str);
+        values.insert(values.end(), leaves.begin(), leaves.end());
+        if (!tree && values.size() > 16) {
+          tree = true;
+          tree_ops = 0;
+        }
+        tree_ops += tree;
+      } else {
+        stack.pop(leaves.size());
+        values.resize(values.size() - std::min(values.size(), leaves.size()));
+        if (tree && ++tree_ops >= 16 && values.size() <= 8) tree = false;
+      }
+      if (leaves.size() <= hybrid_stack<int>::short_string) {
+        assert(!str.indexed_yet());
+      }
+      assert(stack.is_tree() == tree);
+      assert(std::vector<int>(stack) == values);
+      assert(std::equal(stack.rbegin(), stack.rend(), values.rbegin()));
+      if (!values.empty()) assert(stack.back() == values.back());
+    }
+  }
+
+  // round trips across the limit switch too rarely for their cost
+  hybrid_stack<int> crossing(arena);
+  hybrid_string<int> base(std::vector<int>(30, 0)), top(std::vector(70, 1));
+  crossing.append(base);
+  size_t switches = 0;
+  bool was_tree = crossing.is_tree();
+  for (int trip = 0; trip < 256; ++trip) {
+    crossing.append(top);
+    assert(crossing.has_suffix(top));
+    switches += crossing.is_tree() != was_tree;
+    was_tree = crossing.is_tree();
+    crossing.pop(top.size());
+    switches += crossing.is_tree() != was_tree;
+    was_tree = crossing.is_tree();
+  }
+  // one move each way per 64 operations
+  assert(switches <= 2 * (512 / 64 + 1));
+
+  // a string used in stacks in different arenas is indexed in each
+  node_arena other;
+  std::vector<int> long_values(40);
+  for (int &v : long_values) v = (int)(rng() % 2);
+  hybrid_string<int> shared(long_values);
+  hybrid_stack<int> ours(arena, 0), theirs(other, 0);
+  ours.append(shared);
+  theirs.append(hybrid_string<int>(long_values));
+  assert(ours.has_suffix(shared) && theirs.has_suffix(shared));
+  theirs.append(shared);
+  assert(std::vector<int>(ours) == long_values);
+  std::vector<int> twice = long_values;
+  twice.insert(twice.end(), long_values.begin(), long_values.end());
+  assert(std::vector<int>(theirs) == twice);
+}
+
+static_assert(suffix_stack_like<naive_stack<int>>);
+static_assert(suffix_stack_like<tree_stack<int>>);
+static_assert(suffix_stack_like<hybrid_stack<int>>);
+static_assert(suffix_stack_like<virtual_stack<tree_stack<int>>>);
+
+/** the operations of `dispatch_test`, called directly when `Stack` is
+    a concrete stack and virtually when it is a `suffix_stack` */
+template <typename Stack>
+std::vector<bool> dispatch_ops(
+    Stack &stack, const std::vector<typename Stack::string_type> &strings
+) {
+  std::vector<bool> found;
+  for (size_t i = 0; i < strings.size(); ++i) {
+    found.push_back(stack.has_suffix(strings[i]));
+    if (i % 3 == 2) {
+      stack.pop(strings[i].size());
+    } else {
+      stack.append(strings[i]);
+    }
+    if (!stack.empty()) found.push_back(stack.back() == 1);
+  }
+  return found;
+}
+
+/** stacks behave the same whether called directly or through the
+    virtual interface */
+void dispatch_test() {
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  std::vector<std::vector<int>> values(256);
+  std::vector<indexed_string_over<int>> strings;
+  for (std::vector<int> &string : values) {
+    string.resize(rng() % 8);
+    for (int &v : string) v = (int)(rng() % 2);
+    strings.emplace_back(arena, string);
+  }
+
+  tree_stack<int> direct(arena);
+  virtual_stack<tree_stack<int>> wrapped(arena);
+  suffix_stack<indexed_string_over<int>, int> &virtual_ = wrapped;
+  naive_stack<int> naive;
+  std::vector<bool> found = dispatch_ops(direct, strings);
+  assert(dispatch_ops(virtual_, strings) == found);
+  assert(dispatch_ops(naive, values) == found);
+  assert(wrapped.stack == direct && virtual_.size() == naive.size());
+}
+
+/** arenas and stacks count what they do when `SUFFSTACK_STATS` is
+    set, and nothing otherwise */
+void stats_test() {
+  std::vector<int> values(100), more(3);
+  for (size_t i = 0; i < values.size(); ++i) values[i] = (int)(i % 7);
+  node_arena parent;
+  indexed_string_over<int> in_parent(parent, values);
+  node_arena arena(&parent);
+  indexed_string_over<int> shared(arena, values), extra(arena, more);
+  tree_stack<int> stk(arena);
+  stk.append(extra);
+  stk.append(shared);
+  assert(stk.has_suffix(shared) && !stk.has_suffix(extra));
+  stk.pop(2);
+  indexed_string_over<int> top(arena, {values.end() - 7, values.end() - 2});
+  assert(stk.apply(top, extra));
+
+  arena_stats ours = arena.stats(), theirs = parent.stats();
+  stack_stats stack = stk.stats();
+  assert(ours.nodes == arena.size() && ours.bytes == arena.reserved_bytes());
+  assert(ours.load_factor > 0 && ours.load_factor <= 0.5);
+#if SUFFSTACK_STATS
+  assert(ours.hits + ours.misses == ours.interns);
+  assert(ours.misses == arena.size() && theirs.misses == parent.size());
+  // every node of `shared` is found in the parent
+  assert(ours.parent_hits >= parent.size());
+  assert(stack.has_suffix.calls == 2 && stack.has_suffix.descents > 0);
+  assert(stack.append.calls == 3 && stack.append.intern_calls > 0);
+  assert(stack.truncate.calls == 1 && stack.truncate.descents > 0);
+  assert(stack.apply.calls == 1);
+#else
+  assert(!ours.interns && !theirs.interns && !stack.has_suffix.calls);
+#endif
+
+  unordered_node_arena unordered;
+  indexed_string_over<int> in_unordered(unordered, values);
+  arena_stats set_stats = unordered.stats();
+  assert(set_stats.nodes == unordered.nodes.size() && set_stats.nodes > 0);
+  assert(set_stats.bytes >= set_stats.nodes * sizeof(node));
+  assert(set_stats.load_factor == unordered.nodes.load_factor());
+#if SUFFSTACK_STATS
+  assert(set_stats.misses == set_stats.nodes);
+#endif
+}
+
+/** the latency of appending strings of up to `tiny_size`, against the
+    generic path it skips */
+void tiny_benchmark() {
+  std::cout << "Length\tappend\tgeneric (ns per op)";
+  std::mt19937 rng(cfg.seed);
+  node_arena arena;
+  // popped back to their size after each round of appends
+  constexpr size_t ops = 1 << 9, rounds = 64;
+  for (size_t length = 1; length <= tree_stack_base::tiny_size; ++length) {
+    std::vector<int> values(cfg.max_push), leaves(length);
+    for (int &v : values) v = (int)(rng() % 2);
+    for (int &v : leaves) v = (int)(rng() % 2);
+    indexed_string_over<int> str(arena, leaves);
+    // stacks of each alignment
+    std::vector<tree_stack<int>> tiny, generic;
+    for (size_t i = 0; i < 16; ++i) {
+      tiny.emplace_back(arena);
+      tiny.back().append(indexed_string_over<int>(
+          arena, std::vector<int>(values.begin() + i, values.end())
+      ));
+      generic.push_back(tiny.back());
+    }
+    cumulative_timer clk;
+    // a round first to intern the nodes and warm the caches, untimed,
+    // then the paths in alternating order so neither always goes first
+    for (size_t round = 0; round <= rounds; ++round) {
+      if (round == 1) clk.totals.clear();
+      std::array order{std::pair{&tiny, ""}, std::pair{&generic, "g"}};
+      if (round % 2) std::swap(order[0], order[1]);
+      for (auto [stacks, tag] : order) {
+        bool use_generic = *tag;
+        clk.time(std::string("append") + tag, [&]() {
+          for (size_t op = 0; op < ops; ++op) {
+            tree_stack<int> &stk = (*stacks)[op % stacks->size()];
+            if (use_generic) {
+              tiny_append_baseline::append(stk, str);
+            } else {
+              stk.append(str);
+            }
+          }
+        });
+        for (tree_stack<int> &stk : *stacks) {
+          stk.pop(length * ops / stacks->size());
+        }
+      }
+    }
+    for (size_t i = 0; i < tiny.size(); ++i) assert(tiny[i] == generic[i]);
+    auto per_op = [&](const std::string &tag) {
+      std::chrono::duration<double, std::nano> total =
+          clk.totals[tag].duration;
+      return total.count() / double(rounds * ops);
+    };
+    std::cout << "\n"
+              << length << "\t" << per_op("append") << "\t"
+              << per_op("appendg");
+  }
+  std::cout << "\n\n";
+}
 
 int main() {
   tester<naive_stack<int>> naive_stack_test;
   naive_stack_test.run();
 
+  unordered_node_arena unordered_arena;
+  tester<tree_stack<int>, unordered_node_arena> unordered_test(unordered_arena);
+  unordered_test.run();
+  unordered_test.randomised(
+      "unordered_node_arena", cfg.seed, cfg.random_count
+  );
+
   node_arena arena;
   tester<tree_stack<int>, node_arena> tree_stack_test(arena);
   tree_stack_test.run();
-  tree_stack_test.randomised(cfg.seed, cfg.random_count);
+  tree_stack_test.randomised("node_arena", cfg.seed, cfg.random_count);
+
+  basic_node_arena<legacy_node_hash> legacy_arena;
+  tester<tree_stack<int>, basic_node_arena<legacy_node_hash>> legacy_test(
+      legacy_arena
+  );
+  legacy_test.run();
+  legacy_test.randomised(
+      "basic_node_arena<legacy_node_hash>", cfg.seed, cfg.random_count
+  );
+
+  // probes about as long either way, see `mixing_node_hash`
+  std::cout << "Intern table (legacy_node_hash):\n---"
+            << legacy_arena.table_stats()
+            << "\n=========\t=========\t======\n";
+  std::cout << "Intern table (mixing_node_hash):\n---" << arena.table_stats()
+            << "\n\n";
+
+  tester<hybrid_stack<int>, node_arena> hybrid_stack_test(arena);
+  hybrid_stack_test.run();
+  hybrid_stack_test.randomised("hybrid_stack", cfg.seed, cfg.random_count);
+
+  node_arena child_arena(&arena);
+  tester<tree_stack<int>, node_arena> child_test(child_arena);
+  child_test.run();
+  assert(child_arena.size() == 0);
+  promotion_test();
+  rollback_test();
+  collect_test();
+  lazy_test();
+  cache_test();
+  workspace_test();
+  parallel_index_test();
+  batch_test();
+  apply_test();
+  leaf_table_test();
+  subsumed_test();
+  copy_range_test();
+  common_suffix_test();
+  snapshot_test();
+  state_test();
+  peek_test();
+  image_test();
+  static_test();
+  tiny_test();
+  stats_test();
+  hybrid_test();
+  dispatch_test();
+
+  concurrent_node_arena concurrent_arena(
+      nullptr, concurrent_node_arena::bucket_bits_for(1 << 20)
+  );
+  tester<tree_stack<int>, concurrent_node_arena> concurrent_test(
+      concurrent_arena
+  );
+  concurrent_test.run();
+  threaded_scaling();
+  parallel_index_benchmark();
+  collect_benchmark();
+  lazy_benchmark();
+  cache_benchmark();
+  batch_benchmark();
+  iterate_benchmark();
+  tiny_benchmark();
 }